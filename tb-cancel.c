@@ -43,7 +43,7 @@ int tbthread_cancel(tbthread_t thread)
   int ret = 0;
   tbthread_mutex_lock(&desc_mutex);
 
-  if(!list_find_elem(&used_desc, thread)) {
+  if(!tb_find_descriptor(thread)) {
     ret = -ESRCH;
     goto exit;
   }
@@ -74,12 +74,15 @@ struct cleanup_elem {
   void *arg;
 };
 
+static tb_objcache_t cleanup_cache =
+  TB_OBJCACHE_INITIALIZER(sizeof(struct cleanup_elem), 0);
+
 //------------------------------------------------------------------------------
 // Release a cleanup handler
 //------------------------------------------------------------------------------
 static void release_cleanup_handler(void *element)
 {
-  free(element);
+  tb_objcache_free(&cleanup_cache, element);
 }
 
 //------------------------------------------------------------------------------
@@ -118,7 +121,7 @@ void tb_call_cleanup_handlers()
 void tbthread_cleanup_push(void (*func)(void *), void *arg)
 {
   tbthread_t self = tbthread_self();
-  struct cleanup_elem *e = malloc(sizeof(struct cleanup_elem));
+  struct cleanup_elem *e = tb_objcache_alloc(&cleanup_cache);
   e->func = func;
   e->arg = arg;
   list_add_elem(&self->cleanup_handlers, e, 1);
@@ -137,8 +140,8 @@ void tbthread_cleanup_pop(int execute)
   struct cleanup_elem *e = (struct cleanup_elem*)node->element;
   if(execute)
     (*e->func)(e->arg);
-  free(e);
-  free(node);
+  tb_objcache_free(&cleanup_cache, e);
+  tb_objcache_free(&tb_list_cache, node);
 }
 
 //------------------------------------------------------------------------------
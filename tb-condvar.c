@@ -22,20 +22,81 @@
 
 #include <limits.h>
 #include <linux/futex.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+// Init attributes
+//------------------------------------------------------------------------------
+int tbthread_condattr_init(tbthread_condattr_t *attr)
+{
+  memset(attr, 0, sizeof(tbthread_condattr_t));
+  attr->pshared = TBTHREAD_PROCESS_PRIVATE;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy attributes - no op
+//------------------------------------------------------------------------------
+int tbthread_condattr_destroy(tbthread_condattr_t *attr)
+{
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Get process-shared flag
+//------------------------------------------------------------------------------
+int tbthread_condattr_getpshared(const tbthread_condattr_t *attr,
+  int *pshared)
+{
+  *pshared = attr->pshared;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Set process-shared flag
+//------------------------------------------------------------------------------
+int tbthread_condattr_setpshared(tbthread_condattr_t *attr, int pshared)
+{
+  if(pshared != TBTHREAD_PROCESS_PRIVATE && pshared != TBTHREAD_PROCESS_SHARED)
+    return -EINVAL;
+  attr->pshared = pshared;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Initialize the condvar
+//------------------------------------------------------------------------------
+int tbthread_cond_init(tbthread_cond_t *cond, const tbthread_condattr_t *attr)
+{
+  memset(cond, 0, sizeof(tbthread_cond_t));
+  cond->pshared = TBTHREAD_PROCESS_PRIVATE;
+  if(attr)
+    cond->pshared = attr->pshared;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy the condvar - no op
+//------------------------------------------------------------------------------
+int tbthread_cond_destroy(tbthread_cond_t *cond)
+{
+  return 0;
+}
 
 //------------------------------------------------------------------------------
 // Broadcast
 //------------------------------------------------------------------------------
 int tbthread_cond_broadcast(tbthread_cond_t *cond)
 {
-  tb_futex_lock(&cond->lock);
+  tb_futex_lock_pshared(&cond->lock, cond->pshared);
   if(!cond->waiters)
     goto exit;
   ++cond->futex;
   ++cond->broadcast_seq;
-  SYSCALL3(__NR_futex, &cond->futex, FUTEX_WAKE, INT_MAX);
+  SYSCALL3(__NR_futex, &cond->futex,
+           TB_FUTEX_OP(FUTEX_WAKE, cond->pshared), INT_MAX);
 exit:
-  tb_futex_unlock(&cond->lock);
+  tb_futex_unlock_pshared(&cond->lock, cond->pshared);
   return 0;
 }
 
@@ -44,14 +105,15 @@ exit:
 //------------------------------------------------------------------------------
 int tbthread_cond_signal(tbthread_cond_t *cond)
 {
-  tb_futex_lock(&cond->lock);
+  tb_futex_lock_pshared(&cond->lock, cond->pshared);
   if(cond->waiters == cond->signal_num)
     goto exit;
   ++cond->futex;
   ++cond->signal_num;
-  SYSCALL3(__NR_futex, &cond->futex, FUTEX_WAKE, 1);
+  SYSCALL3(__NR_futex, &cond->futex,
+           TB_FUTEX_OP(FUTEX_WAKE, cond->pshared), 1);
 exit:
-  tb_futex_unlock(&cond->lock);
+  tb_futex_unlock_pshared(&cond->lock, cond->pshared);
   return 0;
 }
 
@@ -60,7 +122,7 @@ exit:
 //------------------------------------------------------------------------------
 int tbthread_cond_wait(tbthread_cond_t *cond, tbthread_mutex_t *mutex)
 {
-  tb_futex_lock(&cond->lock);
+  tb_futex_lock_pshared(&cond->lock, cond->pshared);
   int st = 0;
 
   if(!cond->mutex)
@@ -77,14 +139,15 @@ int tbthread_cond_wait(tbthread_cond_t *cond, tbthread_mutex_t *mutex)
   ++cond->waiters;
   int bseq = cond->broadcast_seq;
   int futex = cond->futex;
-  tb_futex_unlock(&cond->lock);
+  tb_futex_unlock_pshared(&cond->lock, cond->pshared);
 
   while(1) {
-    st = SYSCALL3(__NR_futex, &cond->futex, FUTEX_WAIT, futex);
+    st = SYSCALL3(__NR_futex, &cond->futex,
+                  TB_FUTEX_OP(FUTEX_WAIT, cond->pshared), futex);
     if(st == -EINTR)
       continue;
 
-    tb_futex_lock(&cond->lock);
+    tb_futex_lock_pshared(&cond->lock, cond->pshared);
     if(cond->signal_num) {
       --cond->signal_num;
       goto exit;
@@ -92,14 +155,14 @@ int tbthread_cond_wait(tbthread_cond_t *cond, tbthread_mutex_t *mutex)
 
     if(bseq != cond->broadcast_seq)
       goto exit;
-    tb_futex_unlock(&cond->lock);
+    tb_futex_unlock_pshared(&cond->lock, cond->pshared);
   }
 
 error:
   if(!cond->waiters)
     cond->mutex = 0;
 
-  tb_futex_unlock(&cond->lock);
+  tb_futex_unlock_pshared(&cond->lock, cond->pshared);
   return st;
 
 exit:
@@ -107,7 +170,7 @@ exit:
   if(!cond->waiters)
     cond->mutex = 0;
 
-  tb_futex_unlock(&cond->lock);
+  tb_futex_unlock_pshared(&cond->lock, cond->pshared);
   tbthread_mutex_lock(mutex);
   return st;
 }
@@ -83,26 +83,105 @@ static int (*unlockers[])(tbthread_mutex_t *) = {
 //------------------------------------------------------------------------------
 // Low level locking
 //------------------------------------------------------------------------------
-void tb_futex_lock(int *futex)
-{
-  while(1) {
-    if(__sync_bool_compare_and_swap(futex, 0, 1))
-      return;
-    SYSCALL3(__NR_futex, futex, FUTEX_WAIT, 1);
+void tb_futex_lock_pshared(int *futex, int pshared)
+{
+  //----------------------------------------------------------------------------
+  // Fast path: the lock is free and nobody waits for it
+  //----------------------------------------------------------------------------
+  int st = __sync_val_compare_and_swap(futex, TB_FUTEX_UNLOCKED,
+                                       TB_FUTEX_LOCKED);
+  if(st == TB_FUTEX_UNLOCKED)
+    return;
+
+  //----------------------------------------------------------------------------
+  // Slow path: mark the lock as contended before going to sleep, so that the
+  // owner knows that it needs to wake somebody up. We cannot tell whether
+  // there are other sleepers once we get the lock, so we need to keep the
+  // contended mark.
+  //----------------------------------------------------------------------------
+  if(st != TB_FUTEX_CONTENDED)
+    st = __sync_lock_test_and_set(futex, TB_FUTEX_CONTENDED);
+  while(st != TB_FUTEX_UNLOCKED) {
+    SYSCALL3(__NR_futex, futex, TB_FUTEX_OP(FUTEX_WAIT, pshared),
+             TB_FUTEX_CONTENDED);
+    st = __sync_lock_test_and_set(futex, TB_FUTEX_CONTENDED);
   }
 }
 
 int tb_futex_trylock(int *futex)
 {
-  if(__sync_bool_compare_and_swap(futex, 0, 1))
+  if(__sync_bool_compare_and_swap(futex, TB_FUTEX_UNLOCKED, TB_FUTEX_LOCKED))
       return 0;
   return -EBUSY;
 }
 
+void tb_futex_unlock_pshared(int *futex, int pshared)
+{
+  //----------------------------------------------------------------------------
+  // Only call the kernel if the lock has been marked as contended
+  //----------------------------------------------------------------------------
+  if(__sync_fetch_and_sub(futex, 1) != TB_FUTEX_LOCKED) {
+    *futex = TB_FUTEX_UNLOCKED;
+    SYSCALL3(__NR_futex, futex, TB_FUTEX_OP(FUTEX_WAKE, pshared), 1);
+  }
+}
+
+void tb_futex_lock(int *futex)
+{
+  tb_futex_lock_pshared(futex, TBTHREAD_PROCESS_PRIVATE);
+}
+
 void tb_futex_unlock(int *futex)
 {
-  if(__sync_bool_compare_and_swap(futex, 1, 0))
-    SYSCALL3(__NR_futex, futex, FUTEX_WAKE, 1);
+  tb_futex_unlock_pshared(futex, TBTHREAD_PROCESS_PRIVATE);
+}
+
+//------------------------------------------------------------------------------
+// Spin for a while before going to sleep. The spin budget is derived from the
+// number of iterations it took to acquire the lock recently, which is a proxy
+// for how long the lock is typically held. The counter is only updated while
+// holding the lock.
+//------------------------------------------------------------------------------
+void tb_futex_lock_adaptive(int *futex, uint16_t *spin_count, int pshared)
+{
+  if(tb_futex_trylock(futex) == 0)
+    return;
+
+  //----------------------------------------------------------------------------
+  // The owner cannot make any progress while we spin on a single CPU
+  //----------------------------------------------------------------------------
+  if(tb_ncpus < 2) {
+    tb_futex_lock_pshared(futex, pshared);
+    return;
+  }
+
+  int max_spins = *spin_count * 2 + TB_SPIN_MIN;
+  if(max_spins > TB_SPIN_MAX)
+    max_spins = TB_SPIN_MAX;
+
+  int spins = 0;
+  int backoff = 1;
+  while(1) {
+    //--------------------------------------------------------------------------
+    // If somebody has already gone to sleep on the lock, the owner is either
+    // not running or holds the lock for longer than it is worth spinning
+    //--------------------------------------------------------------------------
+    if(spins >= max_spins || *futex == TB_FUTEX_CONTENDED) {
+      tb_futex_lock_pshared(futex, pshared);
+      break;
+    }
+
+    for(int i = 0; i < backoff; ++i)
+      TB_CPU_RELAX();
+    spins += backoff;
+    if(backoff < TB_SPIN_BACKOFF_MAX)
+      backoff <<= 1;
+
+    if(*futex == TB_FUTEX_UNLOCKED && tb_futex_trylock(futex) == 0)
+      break;
+  }
+
+  *spin_count += (spins - *spin_count) / 8;
 }
 
 //------------------------------------------------------------------------------
@@ -200,7 +279,10 @@ static int unlock_recursive(tbthread_mutex_t *mutex)
 //------------------------------------------------------------------------------
 static int lock_prio_none(tbthread_mutex_t *mutex)
 {
-  tb_futex_lock(&mutex->futex);
+  if(mutex->spin == TBTHREAD_MUTEX_SPIN_ADAPTIVE)
+    tb_futex_lock_adaptive(&mutex->futex, &mutex->spin_count, mutex->pshared);
+  else
+    tb_futex_lock_pshared(&mutex->futex, mutex->pshared);
   mutex->owner = tbthread_self();
   return 0;
 }
@@ -216,20 +298,64 @@ static int trylock_prio_none(tbthread_mutex_t *mutex)
 static int unlock_prio_none(tbthread_mutex_t *mutex)
 {
   mutex->owner = 0;
-  tb_futex_unlock(&mutex->futex);
+  tb_futex_unlock_pshared(&mutex->futex, mutex->pshared);
   return 0;
 }
 
 //------------------------------------------------------------------------------
-// Priority inherit
+// Priority inherit using the kernel PI futexes. The futex word holds the TID
+// of the owner, so the uncontended case is a single CAS. Otherwise, the
+// kernel queues the waiters and boosts the owner atomically and transitively.
+//------------------------------------------------------------------------------
+static int lock_pi_futex(tbthread_mutex_t *mutex)
+{
+  tbthread_t self = tbthread_self();
+  if(!__sync_bool_compare_and_swap(&mutex->futex, 0, self->tid)) {
+    int ret;
+    do {
+      ret = SYSCALL4(__NR_futex, &mutex->futex,
+                     TB_FUTEX_OP(FUTEX_LOCK_PI, mutex->pshared), 0, 0);
+    } while(ret == -EAGAIN || ret == -EINTR);
+    if(ret)
+      return ret;
+  }
+  mutex->owner = self;
+  return 0;
+}
+
+static int trylock_pi_futex(tbthread_mutex_t *mutex)
+{
+  tbthread_t self = tbthread_self();
+  if(!__sync_bool_compare_and_swap(&mutex->futex, 0, self->tid))
+    return -EBUSY;
+  mutex->owner = self;
+  return 0;
+}
+
+static int unlock_pi_futex(tbthread_mutex_t *mutex)
+{
+  tbthread_t self = tbthread_self();
+  mutex->owner = 0;
+  if(__sync_bool_compare_and_swap(&mutex->futex, self->tid, 0))
+    return 0;
+  return SYSCALL2(__NR_futex, &mutex->futex,
+                  TB_FUTEX_OP(FUTEX_UNLOCK_PI, mutex->pshared));
+}
+
+//------------------------------------------------------------------------------
+// Priority inherit emulated in user space, for the kernels that don't support
+// PI futexes
 //------------------------------------------------------------------------------
 static int lock_prio_inherit(tbthread_mutex_t *mutex)
 {
+  if(tb_pi_futex)
+    return lock_pi_futex(mutex);
+
   tbthread_t self = tbthread_self();
 
   while(1) {
     int locked = 0;
-    tb_futex_lock(&mutex->internal_futex);
+    tb_futex_lock_pshared(&mutex->internal_futex, mutex->pshared);
     if(mutex->futex == 0) {
       locked = 1;
       mutex->owner = self;
@@ -238,26 +364,30 @@ static int lock_prio_inherit(tbthread_mutex_t *mutex)
     }
     else
       tb_inherit_mutex_sched(mutex, self);
-    tb_futex_unlock(&mutex->internal_futex);
+    tb_futex_unlock_pshared(&mutex->internal_futex, mutex->pshared);
     if(locked)
       return 0;
-    SYSCALL3(__NR_futex, &mutex->futex, FUTEX_WAIT, 1);
+    SYSCALL3(__NR_futex, &mutex->futex,
+             TB_FUTEX_OP(FUTEX_WAIT, mutex->pshared), 1);
   }
 }
 
 static int trylock_prio_inherit(tbthread_mutex_t *mutex)
 {
+  if(tb_pi_futex)
+    return trylock_pi_futex(mutex);
+
   tbthread_t self = tbthread_self();
 
   int locked = 0;
-  tb_futex_lock(&mutex->internal_futex);
+  tb_futex_lock_pshared(&mutex->internal_futex, mutex->pshared);
   if(mutex->futex == 0) {
     locked = 1;
     mutex->owner = self;
     mutex->futex = 1;
     tb_inherit_mutex_add(mutex);
   }
-  tb_futex_unlock(&mutex->internal_futex);
+  tb_futex_unlock_pshared(&mutex->internal_futex, mutex->pshared);
   if(locked)
     return 0;
   return -EBUSY;
@@ -265,12 +395,16 @@ static int trylock_prio_inherit(tbthread_mutex_t *mutex)
 
 static int unlock_prio_inherit(tbthread_mutex_t *mutex)
 {
-  tb_futex_lock(&mutex->internal_futex);
+  if(tb_pi_futex)
+    return unlock_pi_futex(mutex);
+
+  tb_futex_lock_pshared(&mutex->internal_futex, mutex->pshared);
   tb_inherit_mutex_unsched(mutex);
   mutex->owner = 0;
   mutex->futex = 0;
-  SYSCALL3(__NR_futex, &mutex->futex, FUTEX_WAKE, 1);
-  tb_futex_unlock(&mutex->internal_futex);
+  SYSCALL3(__NR_futex, &mutex->futex,
+           TB_FUTEX_OP(FUTEX_WAKE, mutex->pshared), 1);
+  tb_futex_unlock_pshared(&mutex->internal_futex, mutex->pshared);
   return 0;
 }
 
@@ -338,6 +472,47 @@ int tbthread_mutexattr_settype(tbthread_mutexattr_t *attr, int type)
   attr->type = type;
 }
 
+//------------------------------------------------------------------------------
+// Get spin mode
+//------------------------------------------------------------------------------
+int tbthread_mutexattr_getspin(const tbthread_mutexattr_t *attr, int *spin)
+{
+  *spin = attr->spin;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Set spin mode
+//------------------------------------------------------------------------------
+int tbthread_mutexattr_setspin(tbthread_mutexattr_t *attr, int spin)
+{
+  if(spin != TBTHREAD_MUTEX_SPIN_NONE && spin != TBTHREAD_MUTEX_SPIN_ADAPTIVE)
+    return -EINVAL;
+  attr->spin = spin;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Get process-shared flag
+//------------------------------------------------------------------------------
+int tbthread_mutexattr_getpshared(const tbthread_mutexattr_t *attr,
+  int *pshared)
+{
+  *pshared = attr->pshared;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Set process-shared flag
+//------------------------------------------------------------------------------
+int tbthread_mutexattr_setpshared(tbthread_mutexattr_t *attr, int pshared)
+{
+  if(pshared != TBTHREAD_PROCESS_PRIVATE && pshared != TBTHREAD_PROCESS_SHARED)
+    return -EINVAL;
+  attr->pshared = pshared;
+  return 0;
+}
+
 //------------------------------------------------------------------------------
 // Initialize the mutex
 //------------------------------------------------------------------------------
@@ -348,15 +523,21 @@ int tbthread_mutex_init(tbthread_mutex_t *mutex,
   uint8_t type = TBTHREAD_MUTEX_DEFAULT;
   uint8_t protocol = TBTHREAD_PRIO_NONE;
   uint16_t sched_info = 0;
+  uint8_t spin = TBTHREAD_MUTEX_SPIN_NONE;
+  uint8_t pshared = TBTHREAD_PROCESS_PRIVATE;
   if(attr) {
     type = attr->type;
     protocol = attr->protocol;
+    spin = attr->spin;
+    pshared = attr->pshared;
     if(protocol == TBTHREAD_PRIO_PROTECT && attr->prioceiling != 0)
       sched_info = SCHED_INFO_PACK(SCHED_FIFO, attr->prioceiling);
   }
   mutex->type = type;
   mutex->protocol = protocol;
   mutex->sched_info = sched_info;
+  mutex->spin = spin;
+  mutex->pshared = pshared;
 }
 
 //------------------------------------------------------------------------------
@@ -368,25 +549,25 @@ int tbthread_mutex_destroy(tbthread_mutex_t *mutex)
 }
 
 //------------------------------------------------------------------------------
-// Lock the mutex
+// Lock the mutex - the slow path
 //------------------------------------------------------------------------------
-int tbthread_mutex_lock(tbthread_mutex_t *mutex)
+int tbthread_mutex_lock_slow(tbthread_mutex_t *mutex)
 {
   return (*lockers[mutex->type])(mutex);
 }
 
 //------------------------------------------------------------------------------
-// Try locking the mutex
+// Try locking the mutex - the slow path
 //------------------------------------------------------------------------------
-int tbthread_mutex_trylock(tbthread_mutex_t *mutex)
+int tbthread_mutex_trylock_slow(tbthread_mutex_t *mutex)
 {
   return (*trylockers[mutex->type])(mutex);
 }
 
 //------------------------------------------------------------------------------
-// Unlock the mutex
+// Unlock the mutex - the slow path
 //------------------------------------------------------------------------------
-int tbthread_mutex_unlock(tbthread_mutex_t *mutex)
+int tbthread_mutex_unlock_slow(tbthread_mutex_t *mutex)
 {
   return (*unlockers[mutex->type])(mutex);;
 }
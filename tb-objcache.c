@@ -0,0 +1,135 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include "tb.h"
+#include "tb-private.h"
+
+#include <linux/mman.h>
+#include <asm-generic/param.h>
+
+//------------------------------------------------------------------------------
+// Object caches hand out objects of one size carved from slabs mapped directly
+// from the system, so that they never touch the heap or its lock. A slab
+// starts with a pointer to the next slab of the cache, the objects follow.
+// The free objects are kept in a list linked through a word placed right past
+// each of them, so the list never touches the object itself. The constructor
+// runs once, when the slab is carved, so objects need to be returned to the
+// cache in their constructed state.
+//------------------------------------------------------------------------------
+#define SLAB_MIN_OBJECTS 16
+
+#define OBJ_NEXT(cache, obj) (*(void **)((char *)(obj) + (cache)->size))
+
+static uint64_t obj_stride(tb_objcache_t *cache)
+{
+  return cache->size + sizeof(void *);
+}
+
+static uint64_t slab_size(tb_objcache_t *cache)
+{
+  uint64_t size = obj_stride(cache)*SLAB_MIN_OBJECTS + sizeof(void *);
+  size = (size+EXEC_PAGESIZE-1)/EXEC_PAGESIZE;
+  return size*EXEC_PAGESIZE;
+}
+
+//------------------------------------------------------------------------------
+// Map a new slab and put its objects on the free list, needs to be called
+// with the cache lock held
+//------------------------------------------------------------------------------
+static int slab_grow(tb_objcache_t *cache)
+{
+  uint64_t  size = slab_size(cache);
+  char     *slab = tbmmap(NULL, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if((long)slab < 0)
+    return -ENOMEM;
+
+  *(void **)slab = cache->slabs;
+  cache->slabs = slab;
+
+  uint64_t stride = obj_stride(cache);
+  uint64_t num = (size-sizeof(void *))/stride;
+  for(uint64_t i = num; i > 0; --i) {
+    char *obj = slab+sizeof(void *)+(i-1)*stride;
+    if(cache->ctor)
+      (*cache->ctor)(obj);
+    OBJ_NEXT(cache, obj) = cache->free_objs;
+    cache->free_objs = obj;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Create a cache
+//------------------------------------------------------------------------------
+tb_objcache_t *tb_objcache_create(size_t size, void (*ctor)(void *))
+{
+  tb_objcache_t *cache = malloc(sizeof(tb_objcache_t));
+  if(!cache)
+    return 0;
+  tb_objcache_t init = TB_OBJCACHE_INITIALIZER(size, ctor);
+  *cache = init;
+  return cache;
+}
+
+//------------------------------------------------------------------------------
+// Destroy a cache created with tb_objcache_create, all its objects go away
+//------------------------------------------------------------------------------
+void tb_objcache_destroy(tb_objcache_t *cache)
+{
+  uint64_t size = slab_size(cache);
+  while(cache->slabs) {
+    void *slab = cache->slabs;
+    cache->slabs = *(void **)slab;
+    tbmunmap(slab, size);
+  }
+  free(cache);
+}
+
+//------------------------------------------------------------------------------
+// Get an object
+//------------------------------------------------------------------------------
+void *tb_objcache_alloc(tb_objcache_t *cache)
+{
+  void *obj = 0;
+  tb_futex_lock_adaptive(&cache->lock, &cache->lock_spins,
+                         TBTHREAD_PROCESS_PRIVATE);
+  if(!cache->free_objs && slab_grow(cache))
+    goto exit;
+  obj = cache->free_objs;
+  cache->free_objs = OBJ_NEXT(cache, obj);
+
+exit:
+  tb_futex_unlock(&cache->lock);
+  return obj;
+}
+
+//------------------------------------------------------------------------------
+// Return an object
+//------------------------------------------------------------------------------
+void tb_objcache_free(tb_objcache_t *cache, void *obj)
+{
+  if(!obj)
+    return;
+  tb_futex_lock_adaptive(&cache->lock, &cache->lock_spins,
+                         TBTHREAD_PROCESS_PRIVATE);
+  OBJ_NEXT(cache, obj) = cache->free_objs;
+  cache->free_objs = obj;
+  tb_futex_unlock(&cache->lock);
+}
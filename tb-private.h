@@ -39,21 +39,49 @@
 
 #define SIGCANCEL SIGRTMIN
 
-#define TB_START_OK   0
+#define TB_FUTEX_UNLOCKED  0
+#define TB_FUTEX_LOCKED    1
+#define TB_FUTEX_CONTENDED 2
+
+//------------------------------------------------------------------------------
+// Futex operations default to the process-private variants, the kernel can
+// then skip the mm-wide hashing and the page reference
+//------------------------------------------------------------------------------
+#define TB_FUTEX_OP(op, pshared) \
+  ((pshared) ? (op) : ((op) | FUTEX_PRIVATE_FLAG))
+
+#define TB_SPIN_MIN         64
+#define TB_SPIN_MAX         1024
+#define TB_SPIN_BACKOFF_MAX 64
+
+#define TB_CPU_RELAX() asm volatile("pause" ::: "memory")
+
+#define TB_RSEQ_SIG 0x53053053
+
 #define TB_START_WAIT 1
-#define TB_START_EXIT 2
+
+#define TB_RUN_PARKED  0
+#define TB_RUN_RUNNING 1
+#define TB_RUN_DONE    2
+#define TB_RUN_RETIRED 3
+
+// the reservoir thread could not be reset and exits once it's released
+#define TB_RESERVOIR_RETIRING 2
 
 #define SCHED_INFO_PACK(policy, priority) (((uint16_t)policy << 8) | priority)
 #define SCHED_INFO_POLICY(info) (info >> 8)
 #define SCHED_INFO_PRIORITY(info) (info & 0x00ff)
 
 void tb_tls_call_destructors();
+void tb_tls_free_blocks();
 void tb_cancel_handler(int sig, siginfo_t *si, void *ctx);
 void tb_call_cleanup_handlers();
 void tb_clear_cleanup_handlers();
 
 int tb_set_sched(tbthread_t thread, int policy, int priority);
+int tb_set_affinity(tbthread_t thread, const tbthread_cpuset_t *set);
 int tb_compute_sched(tbthread_t thread);
+void tb_sched_clear_mutexes(tbthread_t thread);
 
 void tb_protect_mutex_sched(tbthread_mutex_t *mutex);
 void tb_protect_mutex_unsched(tbthread_mutex_t *mutex);
@@ -61,10 +89,27 @@ void tb_inherit_mutex_add(tbthread_mutex_t *mutex);
 void tb_inherit_mutex_unsched(tbthread_mutex_t *mutex);
 void tb_inherit_mutex_sched(tbthread_mutex_t *mutex, tbthread_t thread);
 
+void tb_malloc_cache_drain();
+
+struct rseq;
+int tb_rseq_push(struct rseq *rs, void *base, uint64_t stride, uint32_t ncpus,
+  void *ptr, uint64_t capacity);
+void *tb_rseq_pop(struct rseq *rs, void *base, uint64_t stride,
+  uint32_t ncpus);
+
 void tb_futex_lock(int *futex);
 int tb_futex_trylock(int *futex);
 void tb_futex_unlock(int *futex);
+void tb_futex_lock_pshared(int *futex, int pshared);
+void tb_futex_unlock_pshared(int *futex, int pshared);
+void tb_futex_lock_adaptive(int *futex, uint16_t *spin_count, int pshared);
+
+list_t *tb_find_descriptor(tbthread_t thread);
 
+extern tb_objcache_t tb_list_cache;
 extern tbthread_mutex_t desc_mutex;
-extern list_t used_desc;
 extern int tb_pid;
+extern int tb_threads_initialized;
+extern int tb_ncpus;
+extern int tb_pi_futex;
+extern int tb_rseq;
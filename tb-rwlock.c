@@ -22,6 +22,67 @@
 
 #include <limits.h>
 #include <linux/futex.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+// Init attributes
+//------------------------------------------------------------------------------
+int tbthread_rwlockattr_init(tbthread_rwlockattr_t *attr)
+{
+  memset(attr, 0, sizeof(tbthread_rwlockattr_t));
+  attr->pshared = TBTHREAD_PROCESS_PRIVATE;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy attributes - no op
+//------------------------------------------------------------------------------
+int tbthread_rwlockattr_destroy(tbthread_rwlockattr_t *attr)
+{
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Get process-shared flag
+//------------------------------------------------------------------------------
+int tbthread_rwlockattr_getpshared(const tbthread_rwlockattr_t *attr,
+  int *pshared)
+{
+  *pshared = attr->pshared;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Set process-shared flag
+//------------------------------------------------------------------------------
+int tbthread_rwlockattr_setpshared(tbthread_rwlockattr_t *attr, int pshared)
+{
+  if(pshared != TBTHREAD_PROCESS_PRIVATE && pshared != TBTHREAD_PROCESS_SHARED)
+    return -EINVAL;
+  attr->pshared = pshared;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Initialize the rwlock
+//------------------------------------------------------------------------------
+int tbthread_rwlock_init(tbthread_rwlock_t *rwlock,
+  const tbthread_rwlockattr_t *attr)
+{
+  memset(rwlock, 0, sizeof(tbthread_rwlock_t));
+  rwlock->pshared = TBTHREAD_PROCESS_PRIVATE;
+  if(attr)
+    rwlock->pshared = attr->pshared;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Destroy the rwlock - no op
+//------------------------------------------------------------------------------
+int tbthread_rwlock_destroy(tbthread_rwlock_t *rwlock)
+{
+  return 0;
+}
 
 //------------------------------------------------------------------------------
 // Lock for reading
@@ -29,18 +90,19 @@
 int tbthread_rwlock_rdlock(tbthread_rwlock_t *rwlock)
 {
   while(1) {
-    tb_futex_lock(&rwlock->lock);
+    tb_futex_lock_pshared(&rwlock->lock, rwlock->pshared);
 
     if(!rwlock->writer && !rwlock->writers_queued) {
       ++rwlock->readers;
-      tb_futex_unlock(&rwlock->lock);
+      tb_futex_unlock_pshared(&rwlock->lock, rwlock->pshared);
       return 0;
     }
     int sleep_status = rwlock->rd_futex;
 
-    tb_futex_unlock(&rwlock->lock);
+    tb_futex_unlock_pshared(&rwlock->lock, rwlock->pshared);
 
-    SYSCALL3(__NR_futex, &rwlock->rd_futex, FUTEX_WAIT, sleep_status);
+    SYSCALL3(__NR_futex, &rwlock->rd_futex,
+             TB_FUTEX_OP(FUTEX_WAIT, rwlock->pshared), sleep_status);
   }
 }
 
@@ -51,7 +113,7 @@ int tbthread_rwlock_wrlock(tbthread_rwlock_t *rwlock)
 {
   int queued = 0;
   while(1) {
-    tb_futex_lock(&rwlock->lock);
+    tb_futex_lock_pshared(&rwlock->lock, rwlock->pshared);
 
     if(!queued) {
       queued = 1;
@@ -61,14 +123,15 @@ int tbthread_rwlock_wrlock(tbthread_rwlock_t *rwlock)
     if(!rwlock->writer && !rwlock->readers) {
       rwlock->writer = tbthread_self();
       --rwlock->writers_queued;
-      tb_futex_unlock(&rwlock->lock);
+      tb_futex_unlock_pshared(&rwlock->lock, rwlock->pshared);
       return 0;
     }
     int sleep_status = rwlock->wr_futex;
 
-    tb_futex_unlock(&rwlock->lock);
+    tb_futex_unlock_pshared(&rwlock->lock, rwlock->pshared);
 
-    SYSCALL3(__NR_futex, &rwlock->wr_futex, FUTEX_WAIT, sleep_status);
+    SYSCALL3(__NR_futex, &rwlock->wr_futex,
+             TB_FUTEX_OP(FUTEX_WAIT, rwlock->pshared), sleep_status);
   }
 }
 
@@ -77,15 +140,17 @@ int tbthread_rwlock_wrlock(tbthread_rwlock_t *rwlock)
 //------------------------------------------------------------------------------
 int tbthread_rwlock_unlock(tbthread_rwlock_t *rwlock)
 {
-  tb_futex_lock(&rwlock->lock);
+  tb_futex_lock_pshared(&rwlock->lock, rwlock->pshared);
   if(rwlock->writer) {
     rwlock->writer = 0;
     if(rwlock->writers_queued) {
       __sync_fetch_and_add(&rwlock->wr_futex, 1);
-      SYSCALL3(__NR_futex, &rwlock->wr_futex, FUTEX_WAKE, 1);
+      SYSCALL3(__NR_futex, &rwlock->wr_futex,
+               TB_FUTEX_OP(FUTEX_WAKE, rwlock->pshared), 1);
     } else {
       __sync_fetch_and_add(&rwlock->rd_futex, 1);
-      SYSCALL3(__NR_futex, &rwlock->rd_futex, FUTEX_WAKE, INT_MAX);
+      SYSCALL3(__NR_futex, &rwlock->rd_futex,
+               TB_FUTEX_OP(FUTEX_WAKE, rwlock->pshared), INT_MAX);
     }
     goto exit;
   }
@@ -93,11 +158,12 @@ int tbthread_rwlock_unlock(tbthread_rwlock_t *rwlock)
   --rwlock->readers;
   if(!rwlock->readers && rwlock->writers_queued) {
     __sync_fetch_and_add(&rwlock->wr_futex, 1);
-    SYSCALL3(__NR_futex, &rwlock->wr_futex, FUTEX_WAKE, 1);
+    SYSCALL3(__NR_futex, &rwlock->wr_futex,
+             TB_FUTEX_OP(FUTEX_WAKE, rwlock->pshared), 1);
   }
 
 exit:
-  tb_futex_unlock(&rwlock->lock);
+  tb_futex_unlock_pshared(&rwlock->lock, rwlock->pshared);
   return 0;
 }
 
@@ -106,7 +172,7 @@ exit:
 //------------------------------------------------------------------------------
 int tbthread_rwlock_tryrdlock(tbthread_rwlock_t *rwlock)
 {
-  tb_futex_lock(&rwlock->lock);
+  tb_futex_lock_pshared(&rwlock->lock, rwlock->pshared);
   int status = -EBUSY;
   if(!rwlock->writer && !rwlock->writers_queued) {
     ++rwlock->readers;
@@ -114,7 +180,7 @@ int tbthread_rwlock_tryrdlock(tbthread_rwlock_t *rwlock)
     goto exit;
   }
 exit:
-  tb_futex_unlock(&rwlock->lock);
+  tb_futex_unlock_pshared(&rwlock->lock, rwlock->pshared);
   return status;
 }
 
@@ -123,7 +189,7 @@ exit:
 //------------------------------------------------------------------------------
 int tbthread_rwlock_trywrlock(tbthread_rwlock_t *rwlock)
 {
-  tb_futex_lock(&rwlock->lock);
+  tb_futex_lock_pshared(&rwlock->lock, rwlock->pshared);
   int status = -EBUSY;
   if(!rwlock->writer && !rwlock->readers) {
     rwlock->writer = tbthread_self();
@@ -131,6 +197,6 @@ int tbthread_rwlock_trywrlock(tbthread_rwlock_t *rwlock)
     goto exit;
   }
 exit:
-  tb_futex_unlock(&rwlock->lock);
+  tb_futex_unlock_pshared(&rwlock->lock, rwlock->pshared);
   return status;
 }
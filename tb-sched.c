@@ -21,6 +21,7 @@
 #include "tb-private.h"
 
 #include <string.h>
+#include <asm-generic/fcntl.h>
 
 //------------------------------------------------------------------------------
 // Set scheduler
@@ -39,6 +40,15 @@ int tb_set_sched(tbthread_t thread, int policy, int priority)
   return ret;
 }
 
+//------------------------------------------------------------------------------
+// Set CPU affinity
+//------------------------------------------------------------------------------
+int tb_set_affinity(tbthread_t thread, const tbthread_cpuset_t *set)
+{
+  return SYSCALL3(__NR_sched_setaffinity, thread->tid,
+                  sizeof(tbthread_cpuset_t), set);
+}
+
 //------------------------------------------------------------------------------
 // Schedule a protected mutex
 //------------------------------------------------------------------------------
@@ -56,7 +66,7 @@ void tb_protect_mutex_sched(tbthread_mutex_t *mutex)
   tbthread_t owner = mutex->owner;
   tb_futex_lock(&owner->lock);
 
-  list_t *node = malloc(sizeof(list_t));
+  list_t *node = tb_objcache_alloc(&tb_list_cache);
   if(!node)
     goto exit;
 
@@ -83,7 +93,7 @@ void tb_protect_mutex_unsched(tbthread_mutex_t *mutex)
     if(node->prev == &owner->protect_mutexes)
       reschedule = 1;
     list_rm(node);
-    free(node);
+    tb_objcache_free(&tb_list_cache, node);
   }
 
   if(reschedule)
@@ -99,18 +109,21 @@ struct inh_mutex {
   uint16_t sched_info;
 };
 
+static tb_objcache_t inh_mutex_cache =
+  TB_OBJCACHE_INITIALIZER(sizeof(struct inh_mutex), 0);
+
 void tb_inherit_mutex_add(tbthread_mutex_t *mutex)
 {
   tbthread_t owner = mutex->owner;
   tb_futex_lock(&owner->lock);
 
-  list_t *node = malloc(sizeof(list_t));
+  list_t *node = tb_objcache_alloc(&tb_list_cache);
   if(!node)
     goto exit;
 
-  struct inh_mutex *el = malloc(sizeof(struct inh_mutex));
+  struct inh_mutex *el = tb_objcache_alloc(&inh_mutex_cache);
   if(!el) {
-    free(node);
+    tb_objcache_free(&tb_list_cache, node);
     goto exit;
   }
   memset(el, 0, sizeof(struct inh_mutex));
@@ -145,12 +158,12 @@ void tb_inherit_mutex_unsched(tbthread_mutex_t *mutex)
 
   struct inh_mutex *im = node->element;
   list_rm(node);
-  free(node);
+  tb_objcache_free(&tb_list_cache, node);
 
   if(im->sched_info == owner->sched_info)
     tb_compute_sched(owner);
 
-  free(im);
+  tb_objcache_free(&inh_mutex_cache, im);
 
 exit:
   tb_futex_unlock(&owner->lock);
@@ -195,6 +208,27 @@ exit:
   tb_futex_unlock(&owner->lock);
 }
 
+//------------------------------------------------------------------------------
+// Forget the priority protect and inherit mutexes of a thread that is done
+// with its user function
+//------------------------------------------------------------------------------
+void tb_sched_clear_mutexes(tbthread_t thread)
+{
+  tb_futex_lock(&thread->lock);
+  list_t *node;
+  while((node = thread->protect_mutexes.next)) {
+    list_rm(node);
+    tb_objcache_free(&tb_list_cache, node);
+  }
+
+  while((node = thread->inherit_mutexes.next)) {
+    list_rm(node);
+    tb_objcache_free(&inh_mutex_cache, node->element);
+    tb_objcache_free(&tb_list_cache, node);
+  }
+  tb_futex_unlock(&thread->lock);
+}
+
 //------------------------------------------------------------------------------
 // Compute scheduler
 //------------------------------------------------------------------------------
@@ -262,7 +296,7 @@ int tbthread_setschedparam(tbthread_t thread, int policy, int priority)
   int ret = 0;
   tbthread_mutex_lock(&desc_mutex);
 
-  if(!list_find_elem(&used_desc, thread)) {
+  if(!tb_find_descriptor(thread)) {
     ret = -ESRCH;
     goto exit;
   }
@@ -277,6 +311,60 @@ exit:
   return ret;
 }
 
+//------------------------------------------------------------------------------
+// The kernel boosts the owners of PI futexes behind our back and
+// sched_getparam doesn't tell, but the priority field of the stat file of the
+// thread does. Real-time priorities show up there as -1-priority. Returns 0
+// if the thread doesn't run as real-time, -1 if we cannot tell.
+//------------------------------------------------------------------------------
+static int kernel_rt_priority(uint32_t tid)
+{
+  char  path[64] = "/proc/self/task/";
+  char *cursor = path + strlen(path);
+  char  digits[10];
+  int   n = 0;
+  do {
+    digits[n++] = '0' + tid % 10;
+    tid /= 10;
+  } while(tid);
+  while(n)
+    *cursor++ = digits[--n];
+  memcpy(cursor, "/stat", 6);
+
+  char buffer[512];
+  int fd = SYSCALL3(__NR_open, path, O_RDONLY, 0);
+  if(fd < 0)
+    return -1;
+  int len = SYSCALL3(__NR_read, fd, buffer, sizeof(buffer)-1);
+  SYSCALL1(__NR_close, fd);
+  if(len <= 0)
+    return -1;
+  buffer[len] = 0;
+
+  //----------------------------------------------------------------------------
+  // The name of the thread may contain spaces, so we count the fields from
+  // the last closing parenthesis, the name is the second one
+  //----------------------------------------------------------------------------
+  char *p = 0;
+  for(int i = 0; i < len; ++i)
+    if(buffer[i] == ')')
+      p = &buffer[i];
+  if(!p)
+    return -1;
+
+  int field = 2;
+  while(*p && field < 18)
+    if(*p++ == ' ')
+      ++field;
+  if(*p != '-')
+    return 0;
+
+  int prio = 0;
+  for(++p; *p >= '0' && *p <= '9'; ++p)
+    prio = prio*10 + *p - '0';
+  return prio - 1;
+}
+
 //------------------------------------------------------------------------------
 // Get scheduling parameters
 //------------------------------------------------------------------------------
@@ -285,7 +373,7 @@ int tbthread_getschedparam(tbthread_t thread, int *policy, int *priority)
   int ret = 0;
   tbthread_mutex_lock(&desc_mutex);
 
-  if(!list_find_elem(&used_desc, thread)) {
+  if(!tb_find_descriptor(thread)) {
     ret = -ESRCH;
     goto exit;
   }
@@ -294,6 +382,20 @@ int tbthread_getschedparam(tbthread_t thread, int *policy, int *priority)
   *policy = SCHED_INFO_POLICY(si);
   *priority = SCHED_INFO_PRIORITY(si);
 
+  //----------------------------------------------------------------------------
+  // Report the effective priority if the kernel has boosted the thread, a
+  // boosted SCHED_NORMAL thread runs like a SCHED_FIFO one
+  //----------------------------------------------------------------------------
+  uint32_t tid = thread->tid;
+  if(tb_pi_futex && tid) {
+    int rt_priority = kernel_rt_priority(tid);
+    if(rt_priority > *priority) {
+      *priority = rt_priority;
+      if(*policy == SCHED_NORMAL)
+        *policy = SCHED_FIFO;
+    }
+  }
+
 exit:
   tbthread_mutex_unlock(&desc_mutex);
   return ret;
@@ -331,3 +433,65 @@ int tbthread_attr_setinheritsched(tbthread_attr_t *attr, int inheritsched)
   attr->sched_inherit = inheritsched;
   return 0;
 }
+
+//------------------------------------------------------------------------------
+// Set CPU affinity of a thread
+//------------------------------------------------------------------------------
+int tbthread_setaffinity(tbthread_t thread, const tbthread_cpuset_t *set)
+{
+  int ret = 0;
+  tbthread_mutex_lock(&desc_mutex);
+
+  if(!tb_find_descriptor(thread) || !thread->tid) {
+    ret = -ESRCH;
+    goto exit;
+  }
+
+  ret = tb_set_affinity(thread, set);
+
+exit:
+  tbthread_mutex_unlock(&desc_mutex);
+  return ret;
+}
+
+//------------------------------------------------------------------------------
+// Get CPU affinity of a thread. The kernel returns the number of bytes it has
+// filled in, so we clear the rest.
+//------------------------------------------------------------------------------
+int tbthread_getaffinity(tbthread_t thread, tbthread_cpuset_t *set)
+{
+  int ret = 0;
+  tbthread_mutex_lock(&desc_mutex);
+
+  if(!tb_find_descriptor(thread) || !thread->tid) {
+    ret = -ESRCH;
+    goto exit;
+  }
+
+  ret = SYSCALL3(__NR_sched_getaffinity, thread->tid,
+                 sizeof(tbthread_cpuset_t), set);
+  if(ret < 0)
+    goto exit;
+
+  memset((char *)set + ret, 0, sizeof(tbthread_cpuset_t) - ret);
+  ret = 0;
+
+exit:
+  tbthread_mutex_unlock(&desc_mutex);
+  return ret;
+}
+
+//------------------------------------------------------------------------------
+// Set attribute CPU affinity
+//------------------------------------------------------------------------------
+int tbthread_attr_setaffinity(tbthread_attr_t *attr,
+  const tbthread_cpuset_t *set)
+{
+  if(!set) {
+    attr->affinity_set = 0;
+    return 0;
+  }
+  attr->affinity = *set;
+  attr->affinity_set = 1;
+  return 0;
+}
@@ -29,14 +29,48 @@
 #include <asm-generic/param.h>
 #include <linux/futex.h>
 #include <asm/prctl.h>
+#include <linux/rseq.h>
 
 //------------------------------------------------------------------------------
 // Prototypes and globals
 //------------------------------------------------------------------------------
 static void release_descriptor(tbthread_t desc);
-static struct tbthread *get_descriptor();
-tbthread_mutex_t desc_mutex = TBTHREAD_MUTEX_INITIALIZER;
+static int get_descriptor(tbthread_t *desc, const tbthread_attr_t *attr);
+static void reservoir_run(tbthread_t th) __attribute__((noreturn));
+static void reservoir_return(tbthread_t th, int detached)
+  __attribute__((noreturn));
+tbthread_mutex_t desc_mutex = {0, 0, TBTHREAD_PRIO_NONE, 0, 0, 0, 0,
+  TBTHREAD_MUTEX_SPIN_ADAPTIVE, 0, TBTHREAD_PROCESS_PRIVATE};
 int tb_pid = 0;
+int tb_threads_initialized = 0;
+int tb_ncpus = 1;
+int tb_pi_futex = 0;
+int tb_rseq = 0;
+
+//------------------------------------------------------------------------------
+// Register the restartable sequence area of the current thread, the kernel
+// needs it aligned to 32 bytes
+//------------------------------------------------------------------------------
+static struct rseq *rseq_area(tbthread_t th)
+{
+  return (struct rseq *)(((uint64_t)th->rseq_area + 31) & ~31ULL);
+}
+
+static int rseq_register(tbthread_t th)
+{
+  struct rseq *area = rseq_area(th);
+  int ret = SYSCALL4(__NR_rseq, area, sizeof(struct rseq), 0, TB_RSEQ_SIG);
+  if(!ret)
+    th->rseq = area;
+  return ret;
+}
+
+//------------------------------------------------------------------------------
+// Glibc registers an area for the threads it creates, including the main one,
+// and tells us where it is relative to its thread pointer
+//------------------------------------------------------------------------------
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
 
 //------------------------------------------------------------------------------
 // Initialize threading
@@ -50,9 +84,41 @@ void tbthread_init()
   thread->self = thread;
   thread->sched_info = SCHED_INFO_PACK(SCHED_NORMAL, 0);
   SYSCALL2(__NR_arch_prctl, ARCH_SET_FS, thread);
+  tb_threads_initialized = 1;
   tb_pid = SYSCALL0(__NR_getpid);
   thread->tid = tb_pid;
 
+  //----------------------------------------------------------------------------
+  // Count the CPUs we may run on, spinning on locks makes no sense if there is
+  // only one
+  //----------------------------------------------------------------------------
+  uint64_t cpu_mask[16];
+  int mask_size = SYSCALL3(__NR_sched_getaffinity, 0, sizeof(cpu_mask),
+                           cpu_mask);
+  if(mask_size > 0) {
+    tb_ncpus = 0;
+    for(int i = 0; i < mask_size/sizeof(uint64_t); ++i)
+      tb_ncpus += __builtin_popcountll(cpu_mask[i]);
+  }
+
+  //----------------------------------------------------------------------------
+  // Check if the kernel supports priority inheritance futexes. Unlocking
+  // a futex we don't own fails with EPERM if it does.
+  //----------------------------------------------------------------------------
+  int pi_probe = 0;
+  if(SYSCALL2(__NR_futex, &pi_probe, FUTEX_UNLOCK_PI_PRIVATE) != -ENOSYS)
+    tb_pi_futex = 1;
+
+  //----------------------------------------------------------------------------
+  // Register for restartable sequences. If glibc got there first, the kernel
+  // refuses a second area and we use glibc's.
+  //----------------------------------------------------------------------------
+  int rseq_status = rseq_register(thread);
+  if(rseq_status && rseq_status != -ENOSYS && &__rseq_size && __rseq_size)
+    thread->rseq = (struct rseq *)((char *)glibc_thread_desc + __rseq_offset);
+  if(thread->rseq)
+    tb_rseq = 1;
+
   struct sigaction sa;
   memset(&sa, 0, sizeof(struct sigaction));
   sa.sa_handler = (__sighandler_t)tb_cancel_handler;
@@ -65,7 +131,14 @@ void tbthread_init()
 //------------------------------------------------------------------------------
 void tbthread_finit()
 {
-  free(tbthread_self());
+  tbthread_t self = tbthread_self();
+  tb_tls_free_blocks();
+  tb_malloc_cache_drain();
+  tb_threads_initialized = 0;
+  if(self->rseq == rseq_area(self))
+    SYSCALL4(__NR_rseq, self->rseq, sizeof(struct rseq), RSEQ_FLAG_UNREGISTER,
+             TB_RSEQ_SIG);
+  free(self);
   SYSCALL2(__NR_arch_prctl, ARCH_SET_FS, glibc_thread_desc);
 }
 
@@ -88,22 +161,55 @@ int tbthread_attr_setdetachstate(tbthread_attr_t *attr, int state)
     attr->joinable = 1;
 }
 
+int tbthread_attr_setdescplacement(tbthread_attr_t *attr, int placement)
+{
+  if(placement != TBTHREAD_DESC_SEPARATE &&
+     placement != TBTHREAD_DESC_IN_STACK)
+    return -EINVAL;
+  attr->desc_placement = placement;
+  return 0;
+}
+
+int tbthread_attr_setgroup(tbthread_attr_t *attr, tbthread_group_t *group)
+{
+  attr->group = group;
+  return 0;
+}
+
 //------------------------------------------------------------------------------
 // Thread function wrapper
 //------------------------------------------------------------------------------
 static int start_thread(void *arg)
 {
   tbthread_t th = (tbthread_t)arg;
+  if(tb_rseq)
+    rseq_register(th);
 
   //----------------------------------------------------------------------------
-  // Wait until we can run the user function
+  // Apply the scheduling parameters and the CPU affinity requested by the
+  // creator, who waits for us to report back. The attributes and the result
+  // live on the creator's stack, so we cannot touch them after that. If
+  // something fails, we exit without running the user function.
   //----------------------------------------------------------------------------
-  if(th->start_status != TB_START_OK) {
-    SYSCALL3(__NR_futex, &th->start_status, FUTEX_WAIT, TB_START_WAIT);
-    if(th->start_status == TB_START_EXIT)
+  if(th->start_attr) {
+    const tbthread_attr_t *attr = th->start_attr;
+    int32_t *start_result = th->start_result;
+    int ret = 0;
+    if(!attr->sched_inherit)
+      ret = tb_set_sched(th, attr->sched_policy, attr->sched_priority);
+    if(!ret && attr->affinity_set)
+      ret = tb_set_affinity(th, &attr->affinity);
+
+    th->start_attr = 0;
+    *start_result = ret;
+    SYSCALL3(__NR_futex, start_result, FUTEX_WAKE_PRIVATE, 1);
+    if(ret)
       SYSCALL1(__NR_exit, 0);
   }
 
+  if(th->reservoir)
+    reservoir_run(th);
+
   //----------------------------------------------------------------------------
   // Run the user function
   //----------------------------------------------------------------------------
@@ -114,102 +220,323 @@ static int start_thread(void *arg)
   return 0;
 }
 
+//------------------------------------------------------------------------------
+// Thread groups. The counter and the list of the finished members that wait to
+// be joined are protected by desc_mutex. Every departure bumps the sequence
+// number, which is what the waiters sleep on.
+//------------------------------------------------------------------------------
+static void group_leave(tbthread_group_t *group, tbthread_t joinable)
+{
+  if(joinable)
+    list_add(&group->done, &joinable->group_node, 1);
+  --group->running;
+  ++group->seq;
+}
+
+static void group_wake(tbthread_group_t *group)
+{
+  SYSCALL3(__NR_futex, &group->seq, FUTEX_WAKE_PRIVATE, INT_MAX);
+}
+
+//------------------------------------------------------------------------------
+// Take a finished member off the list of its group, so that the group waiters
+// cannot claim it anymore, must be called with desc_mutex held
+//------------------------------------------------------------------------------
+static void group_unlink(tbthread_t th)
+{
+  if(th->group_node.prev) {
+    list_rm(&th->group_node);
+    th->group_node.prev = 0;
+  }
+}
+
 //------------------------------------------------------------------------------
 // Terminate the current thread
 //------------------------------------------------------------------------------
 void tbthread_exit(void *retval)
 {
   tbthread_t th = tbthread_self();
-  uint32_t stack_size = th->stack_size;
-  void *stack = th->stack;
+  tbthread_group_t *group = th->group;
   int free_desc = 0;
 
   th->retval = retval;
   tb_call_cleanup_handlers();
   tb_tls_call_destructors();
+  tb_tls_free_blocks();
 
   tbthread_mutex_lock(&desc_mutex);
   if(th->join_status == TB_DETACHED)
     free_desc = 1;
   th->join_status = TB_JOINABLE_FIXED;
+  if(group)
+    group_leave(group, (free_desc || th->joiner) ? 0 : th);
   tbthread_mutex_unlock(&desc_mutex);
 
+  if(group)
+    group_wake(group);
+
+  if(th->reservoir)
+    reservoir_return(th, free_desc);
+
   if(free_desc)
     release_descriptor(th);
 
   //----------------------------------------------------------------------------
-  // Free the stack and exit. We do it this way because we remove the stack from
-  // underneath our feet and cannot allow the C code to write on it anymore.
+  // Nothing allocates or frees memory past this point, so we can give the
+  // cached blocks back to the heap
   //----------------------------------------------------------------------------
-  register long a1 asm("rdi") = (long)stack;
-  register long a2 asm("rsi") = stack_size;
-  asm volatile(
-    "syscall\n\t"
-    "movq $60, %%rax\n\t" // 60 = __NR_exit
-    "movq $0, %%rdi\n\t"
-    "syscall"
-    :
-    : "a" (__NR_munmap), "r" (a1), "r" (a2)
-    : "memory", "cc", "r11", "cx");
+  tb_malloc_cache_drain();
+
+  //----------------------------------------------------------------------------
+  // The stack stays with the descriptor to be reused. Nobody touches it before
+  // the kernel clears our TID.
+  //----------------------------------------------------------------------------
+  SYSCALL1(__NR_exit, 0);
+  __builtin_unreachable();
+}
+
+//------------------------------------------------------------------------------
+// Check if the thread is done. The reservoir threads don't exit, they tell us
+// when the user function has returned.
+//------------------------------------------------------------------------------
+static int thread_done(tbthread_t thread)
+{
+  if(thread->reservoir)
+    return thread->run_status == TB_RUN_DONE;
+  return thread->tid == 0;
 }
 
 //------------------------------------------------------------------------------
-// Wait for exit
+// Wait for exit, until abstime on CLOCK_REALTIME if it's given. The kernel
+// wakes the TID futex up with a shared FUTEX_WAKE when the thread exits, so we
+// cannot use the private variant here. For the reservoir threads we wait on
+// the run status instead.
 //------------------------------------------------------------------------------
-static void wait_for_thread(tbthread_t thread)
+static int wait_for_thread(tbthread_t thread, const struct timespec *abstime)
 {
-  uint32_t tid = thread->tid;
-  long ret = 0;
-  if(tid != 0)
-    do {
-      ret = SYSCALL3(__NR_futex, &thread->tid, FUTEX_WAIT, tid);
-    } while(ret != -EWOULDBLOCK && ret != 0);
+  uint32_t *addr = &thread->tid;
+  uint32_t done = 0;
+  int op = FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME;
+  if(thread->reservoir) {
+    addr = &thread->run_status;
+    done = TB_RUN_DONE;
+    op = FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME;
+  }
+
+  uint32_t val;
+  long ret;
+  while((val = *addr) != done) {
+    ret = SYSCALL6(__NR_futex, addr, op, val, abstime, 0,
+                   FUTEX_BITSET_MATCH_ANY);
+    if(ret == -ETIMEDOUT || ret == -EINVAL)
+      return ret;
+  }
+  return 0;
 }
 
 //------------------------------------------------------------------------------
-// Descriptor lists
+// Descriptor lists. Up to TB_STACK_CACHE_MAX of the free descriptors keep the
+// stacks of their last threads, so that they can be reused without going back
+// to the kernel. A stack may only be reused or unmapped after the kernel
+// clears the TID of the thread that ran on it. Descriptors placed in the
+// stack mapping are always cached with it and go away when it is unmapped.
 //------------------------------------------------------------------------------
-list_t used_desc;
+#define TB_STACK_CACHE_MAX 16
+
 static list_t free_desc;
+static list_t *free_desc_tail = &free_desc;
+static list_t stack_desc;
+static int cached_stacks;
+
+//------------------------------------------------------------------------------
+// The reservoir. The parked threads that are ready to take on work are kept
+// on the list, all of them were created with the same attributes.
+//------------------------------------------------------------------------------
+static list_t reservoir_desc;
+static tbthread_attr_t reservoir_attr;
+static uint16_t reservoir_sched_info;
+static tbthread_cpuset_t reservoir_affinity;
+static int reservoir_initialized;
+
+//------------------------------------------------------------------------------
+// The descriptors in use are kept in a hash table of lists keyed by their
+// addresses, so that we can validate the handles passed to us by the user
+// without walking all the threads. The table doubles when it holds more
+// descriptors than buckets. All of it is protected by desc_mutex.
+//------------------------------------------------------------------------------
+#define DESC_HASH_BITS_INIT 6
+
+static list_t   desc_buckets_init[1 << DESC_HASH_BITS_INIT];
+static list_t  *desc_buckets = desc_buckets_init;
+static uint32_t desc_hash_bits = DESC_HASH_BITS_INIT;
+static uint32_t desc_count;
+
+static inline list_t *desc_bucket(tbthread_t desc)
+{
+  uint64_t hash = (uint64_t)desc * 0x9e3779b97f4a7c15ULL;
+  return &desc_buckets[hash >> (64 - desc_hash_bits)];
+}
+
+//------------------------------------------------------------------------------
+// Grow the descriptor table. If we fail to allocate memory, we just keep on
+// using the old one with longer chains.
+//------------------------------------------------------------------------------
+static void desc_table_grow()
+{
+  uint32_t old_size = 1 << desc_hash_bits;
+  list_t *new_buckets = calloc(old_size * 2, sizeof(list_t));
+  if(!new_buckets)
+    return;
+
+  list_t *old_buckets = desc_buckets;
+  desc_buckets = new_buckets;
+  ++desc_hash_bits;
+  for(uint32_t i = 0; i < old_size; ++i) {
+    while(old_buckets[i].next) {
+      list_t *node = old_buckets[i].next;
+      list_rm(node);
+      list_add(desc_bucket(node->element), node, 1);
+    }
+  }
+
+  if(old_buckets != desc_buckets_init)
+    free(old_buckets);
+}
+
+//------------------------------------------------------------------------------
+// Add a descriptor to the table, we need to hold desc_mutex
+//------------------------------------------------------------------------------
+static void desc_table_add(list_t *node)
+{
+  if(++desc_count > (1 << desc_hash_bits))
+    desc_table_grow();
+  list_add(desc_bucket(node->element), node, 1);
+}
+
+//------------------------------------------------------------------------------
+// Find a descriptor in use, we need to hold desc_mutex
+//------------------------------------------------------------------------------
+list_t *tb_find_descriptor(tbthread_t thread)
+{
+  return list_find_elem(desc_bucket(thread), thread);
+}
+
+//------------------------------------------------------------------------------
+// Put a descriptor without a stack at the end of the free list, so that it
+// gets reused as late as possible and its thread has time to exit; take one
+// from the front
+//------------------------------------------------------------------------------
+static void free_desc_push(list_t *node)
+{
+  list_add(free_desc_tail, node, 1);
+  free_desc_tail = node;
+}
+
+static list_t *free_desc_pop()
+{
+  list_t *node = free_desc.next;
+  if(!node)
+    return 0;
+  if(node == free_desc_tail)
+    free_desc_tail = &free_desc;
+  list_rm(node);
+  return node;
+}
 
 //------------------------------------------------------------------------------
-// Get a descriptor
+// Allocate a stack with a guard page at the end so that we could protect from
+// overflows (by receiving a SIGSEGV)
 //------------------------------------------------------------------------------
-static struct tbthread *get_descriptor()
+static void *alloc_stack(uint32_t size)
 {
-  tbthread_t  desc = 0;
-  list_t     *node = 0;
+  void *stack = tbmmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  long status = (long)stack;
+  if(status < 0)
+    return stack;
+
+  status = SYSCALL3(__NR_mprotect, stack, EXEC_PAGESIZE, PROT_NONE);
+  if(status < 0) {
+    tbmunmap(stack, size);
+    return (void *)status;
+  }
+  return stack;
+}
+
+//------------------------------------------------------------------------------
+// Descriptors placed in the stack mapping occupy the top of it
+//------------------------------------------------------------------------------
+#define DESC_IN_STACK(stack, size) \
+  ((tbthread_t)((char *)(stack) + (size) - \
+                TB_CACHELINE_ROUND(sizeof(struct tbthread))))
+
+//------------------------------------------------------------------------------
+// Get a descriptor, with a stack of the requested size if we have one
+//------------------------------------------------------------------------------
+static int get_descriptor(tbthread_t *desc, const tbthread_attr_t *attr)
+{
+  list_t *node = 0;
+  *desc = 0;
 
   //----------------------------------------------------------------------------
   // Try to re-use a thread descriptor and make sure that the corresponding
   // thread has actually exited
   //----------------------------------------------------------------------------
   tbthread_mutex_lock(&desc_mutex);
-  node = free_desc.next;
-  if(node)
+  for(node = stack_desc.next; node; node = node->next) {
+    tbthread_t cached = (tbthread_t)node->element;
+    if(cached->stack_size == attr->stack_size &&
+       cached->desc_placement == attr->desc_placement)
+      break;
+  }
+  if(node) {
+    --cached_stacks;
     list_rm(node);
+  }
+  else if(attr->desc_placement == TBTHREAD_DESC_SEPARATE)
+    node = free_desc_pop();
   tbthread_mutex_unlock(&desc_mutex);
 
   if(node) {
-    desc = (tbthread_t)node->element;
-    wait_for_thread(desc);
+    *desc = (tbthread_t)node->element;
+    wait_for_thread(*desc, 0);
   }
 
   //----------------------------------------------------------------------------
   // We don't have any free descriptors so we allocate and add to the list of
-  // used descriptors
+  // used descriptors. If the descriptor goes in the stack mapping, we need to
+  // allocate the stack right away. A new descriptor starts zeroed, so that the
+  // error path of spawn_thread finds no stack, group or reservoir in it.
   //----------------------------------------------------------------------------
   if(!node) {
-    desc = malloc(sizeof(struct tbthread));
-    node = malloc(sizeof(list_t));
-    node->element = desc;
+    node = tb_objcache_alloc(&tb_list_cache);
+    if(!node)
+      return -ENOMEM;
+
+    if(attr->desc_placement == TBTHREAD_DESC_IN_STACK) {
+      void *stack = alloc_stack(attr->stack_size);
+      if((long)stack < 0) {
+        tb_objcache_free(&tb_list_cache, node);
+        return (long)stack;
+      }
+      *desc = DESC_IN_STACK(stack, attr->stack_size);
+      (*desc)->stack = stack;
+    }
+    else {
+      *desc = malloc(sizeof(struct tbthread));
+      if(!*desc) {
+        tb_objcache_free(&tb_list_cache, node);
+        return -ENOMEM;
+      }
+      memset(*desc, 0, sizeof(struct tbthread));
+    }
+    node->element = *desc;
   }
 
   tbthread_mutex_lock(&desc_mutex);
-
-  list_add(&used_desc, node, 0);
+  desc_table_add(node);
   tbthread_mutex_unlock(&desc_mutex);
-  return desc;
+  return 0;
 }
 
 //------------------------------------------------------------------------------
@@ -218,49 +545,107 @@ static struct tbthread *get_descriptor()
 static void release_descriptor(tbthread_t desc)
 {
   tbthread_mutex_lock(&desc_mutex);
-  list_t *node = list_find_elem(&used_desc, desc);
+
+  group_unlink(desc);
+  desc->group = 0;
+
+  //----------------------------------------------------------------------------
+  // The threads of the reservoir keep their descriptors, they just become
+  // available for the next tbthread_create
+  //----------------------------------------------------------------------------
+  if(desc->reservoir == TB_RESERVOIR_RETIRING) {
+    desc->run_status = TB_RUN_RETIRED;
+    tbthread_mutex_unlock(&desc_mutex);
+    SYSCALL3(__NR_futex, &desc->run_status, FUTEX_WAKE_PRIVATE, 1);
+    return;
+  }
+
+  if(desc->reservoir) {
+    desc->join_status = TB_DETACHED;
+    desc->run_status = TB_RUN_PARKED;
+    list_add(&reservoir_desc, &desc->reservoir_node, 1);
+    tbthread_mutex_unlock(&desc_mutex);
+    return;
+  }
+
+  list_t *node = tb_find_descriptor(desc);
   if(!node) {
     tbprint("Releasing unknown descriptor: 0x%llx! Scared and confused!\n",
             desc);
     // abort!
   }
   list_rm(node);
-  list_add(&free_desc, node, 0);
+  --desc_count;
+
+  //----------------------------------------------------------------------------
+  // Keep the stack if there is room in the cache, make room otherwise by
+  // unmapping the stack that was cached the longest
+  //----------------------------------------------------------------------------
+  list_t *evicted = 0;
+  if(desc->stack) {
+    list_add(&stack_desc, node, 1);
+    if(++cached_stacks > TB_STACK_CACHE_MAX) {
+      for(evicted = stack_desc.next; evicted->next; evicted = evicted->next);
+      list_rm(evicted);
+      --cached_stacks;
+    }
+  }
+  else
+    free_desc_push(node);
   tbthread_mutex_unlock(&desc_mutex);
+
+  if(evicted) {
+    tbthread_t old = (tbthread_t)evicted->element;
+    wait_for_thread(old, 0);
+    if(old->desc_placement == TBTHREAD_DESC_IN_STACK) {
+      tbmunmap(old->stack, old->stack_size);
+      tb_objcache_free(&tb_list_cache, evicted);
+      return;
+    }
+    tbmunmap(old->stack, old->stack_size);
+    old->stack = 0;
+    tbthread_mutex_lock(&desc_mutex);
+    free_desc_push(evicted);
+    tbthread_mutex_unlock(&desc_mutex);
+  }
 }
 
 //------------------------------------------------------------------------------
-// Spawn a thread
+// Spawn a new thread, reservoir threads park before running anything
 //------------------------------------------------------------------------------
-int tbthread_create(
+static int spawn_thread(
   tbthread_t            *thread,
   const tbthread_attr_t *attr,
   void                  *(*f)(void *),
-  void                  *arg)
+  void                  *arg,
+  int                    reservoir)
 {
-  int ret = 0;
-  *thread = 0;
+  int ret = get_descriptor(thread, attr);
+  if(ret)
+    return ret;
 
   //----------------------------------------------------------------------------
-  // Allocate the stack with a guard page at the end so that we could protect
-  // from overflows (by receiving a SIGSEGV)
+  // Allocate the stack unless the descriptor comes with one
   //----------------------------------------------------------------------------
-  void *stack = tbmmap(NULL, attr->stack_size, PROT_READ | PROT_WRITE,
-                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  long status = (long)stack;
-  if(status < 0)
-    return status;
-
-  status = SYSCALL3(__NR_mprotect, stack, EXEC_PAGESIZE, PROT_NONE);
-  if(status < 0) {
-    ret = status;
-    goto error;
+  void *stack = (*thread)->stack;
+  if(!stack) {
+    stack = alloc_stack(attr->stack_size);
+    if((long)stack < 0) {
+      ret = (long)stack;
+      goto error;
+    }
   }
 
+  //----------------------------------------------------------------------------
+  // The stack starts right below the descriptor if it lives in the mapping
+  //----------------------------------------------------------------------------
+  void *stack_top = stack + attr->stack_size;
+  if(attr->desc_placement == TBTHREAD_DESC_IN_STACK)
+    stack_top = *thread;
+
   //----------------------------------------------------------------------------
   // Pack everything up
   //----------------------------------------------------------------------------
-  *thread = get_descriptor();
   memset(*thread, 0, sizeof(struct tbthread));
   (*thread)->self = *thread;
   (*thread)->stack = stack;
@@ -268,16 +653,36 @@ int tbthread_create(
   (*thread)->fn = f;
   (*thread)->arg = arg;
   (*thread)->join_status = attr->joinable;
+  (*thread)->desc_placement = attr->desc_placement;
   (*thread)->cancel_status = TB_CANCEL_ENABLED | TB_CANCEL_DEFERRED;
+  (*thread)->reservoir = reservoir;
+  (*thread)->reservoir_node.element = *thread;
+  (*thread)->group_node.element = *thread;
 
   //----------------------------------------------------------------------------
-  // If we set a scheduling policy, we need to make sure that the thread goes to
-  // sleep immediately after it starts so that we can make sure that we can
-  // successfuly set the before the user function executes.
+  // The group has to count us in before we can possibly leave it. The threads
+  // of the reservoir join groups when they get work.
   //----------------------------------------------------------------------------
-  if(!attr->sched_inherit)
-    (*thread)->start_status = TB_START_WAIT;
-  else {
+  if(attr->group && !reservoir) {
+    tbthread_mutex_lock(&desc_mutex);
+    ++attr->group->running;
+    tbthread_mutex_unlock(&desc_mutex);
+    (*thread)->group = attr->group;
+  }
+
+  //----------------------------------------------------------------------------
+  // If we set a scheduling policy or CPU affinity, the thread does it itself
+  // before running the user function and tells us whether it has succeeded.
+  // We cannot look at the descriptor to find out, because a detached thread
+  // may be long gone by the time we wake up.
+  //----------------------------------------------------------------------------
+  int32_t start_result = 0;
+  if(!attr->sched_inherit || attr->affinity_set) {
+    start_result = TB_START_WAIT;
+    (*thread)->start_attr = attr;
+    (*thread)->start_result = &start_result;
+  }
+  if(attr->sched_inherit) {
     tbthread_t self = tbthread_self();
     (*thread)->sched_info = self->sched_info;
   }
@@ -287,43 +692,247 @@ int tbthread_create(
   //----------------------------------------------------------------------------
   int flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SYSVSEM | CLONE_SIGHAND;
   flags |= CLONE_THREAD | CLONE_SETTLS;
-  flags |= CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID;
+  flags |= CLONE_PARENT_SETTID | CLONE_CHILD_SETTID | CLONE_CHILD_CLEARTID;
 
-  int tid = tbclone(start_thread, *thread, flags, stack+attr->stack_size,
-                    0, &(*thread)->tid, *thread);
+  //----------------------------------------------------------------------------
+  // The kernel fills the TID in before the child gets to run, so we don't need
+  // to store it ourselves. Doing so after clone returns could overwrite the
+  // zero the kernel writes if the child exits quickly enough.
+  //----------------------------------------------------------------------------
+  int tid = tbclone(start_thread, *thread, flags, stack_top,
+                    &(*thread)->tid, &(*thread)->tid, *thread);
   if(tid < 0) {
     ret = tid;
     goto error;
   }
 
   //----------------------------------------------------------------------------
-  // It may happen that we will start to wait for this futex before the kernel
-  // manages to fill it with something meaningful.
+  // Wait for the thread to set itself up. If it has failed, it's going to exit
+  // on its own, so we wait for that too.
   //----------------------------------------------------------------------------
-  (*thread)->tid = tid;
+  while(start_result == TB_START_WAIT)
+    SYSCALL3(__NR_futex, &start_result, FUTEX_WAIT_PRIVATE, TB_START_WAIT);
+
+  if(start_result) {
+    ret = start_result;
+    (*thread)->reservoir = 0;
+    wait_for_thread(*thread, 0);
+    goto error;
+  }
+  return 0;
+
+error:
+  if((*thread)->group) {
+    tbthread_mutex_lock(&desc_mutex);
+    group_leave((*thread)->group, 0);
+    tbthread_mutex_unlock(&desc_mutex);
+    group_wake((*thread)->group);
+  }
+  (*thread)->reservoir = 0;
+  release_descriptor(*thread);
+  return ret;
+}
+
+//------------------------------------------------------------------------------
+// Run the user functions handed over to a reservoir thread. A retired thread
+// leaves the reservoir and goes away like a detached one.
+//------------------------------------------------------------------------------
+static void reservoir_run(tbthread_t th)
+{
+  uint32_t status;
+  while((status = th->run_status) != TB_RUN_RUNNING) {
+    if(status == TB_RUN_RETIRED) {
+      th->reservoir = 0;
+      release_descriptor(th);
+      tb_malloc_cache_drain();
+      SYSCALL1(__NR_exit, 0);
+    }
+    SYSCALL3(__NR_futex, &th->run_status, FUTEX_WAIT_PRIVATE, status);
+  }
+
+  void *ret = th->fn(th->arg);
+  tbthread_setcancelstate(TBTHREAD_CANCEL_DISABLE, 0);
+  tb_clear_cleanup_handlers();
+  tbthread_exit(ret);
+}
+
+//------------------------------------------------------------------------------
+// Undo whatever the user function did to the scheduling of the thread, so that
+// the next one gets what the reservoir was created with
+//------------------------------------------------------------------------------
+static int reservoir_reset(tbthread_t th)
+{
+  tb_sched_clear_mutexes(th);
+  th->user_sched_info = 0;
+
+  uint16_t sched_info = reservoir_sched_info;
+  if(!reservoir_attr.sched_inherit)
+    sched_info = SCHED_INFO_PACK(reservoir_attr.sched_policy,
+                                 reservoir_attr.sched_priority);
+
+  int ret = 0;
+  if(th->sched_info != sched_info)
+    ret = tb_set_sched(th, SCHED_INFO_POLICY(sched_info),
+                       SCHED_INFO_PRIORITY(sched_info));
+  if(!ret)
+    ret = tb_set_affinity(th, &reservoir_affinity);
+  return ret;
+}
+
+//------------------------------------------------------------------------------
+// Go back to the reservoir when the user function is done. We may have been
+// called from deep within the user code or from the cancelation signal
+// handler, so we start over at the top of the stack with the cancelation
+// signal unblocked.
+//------------------------------------------------------------------------------
+static void reservoir_return(tbthread_t th, int detached)
+{
+  memset(th->tls, 0, sizeof(th->tls));
+
+  uint64_t mask = 1ULL << (SIGCANCEL-1);
+  SYSCALL4(__NR_rt_sigprocmask, SIG_UNBLOCK, &mask, 0, sizeof(mask));
+
+  if(reservoir_reset(th))
+    th->reservoir = TB_RESERVOIR_RETIRING;
 
   //----------------------------------------------------------------------------
-  // Set scheduling policy. If we succeed, we let the thread run. If not, we
-  // wait for it to exit;
+  // If nobody is going to join us, we're available right away. Otherwise, the
+  // joiner puts us back when it has collected the return value. If we could
+  // not be reset, we retire instead of going back.
   //----------------------------------------------------------------------------
-  if(!attr->sched_inherit) {
-    ret = tb_set_sched(*thread, attr->sched_policy, attr->sched_priority);
+  if(detached)
+    release_descriptor(th);
+  else {
+    th->run_status = TB_RUN_DONE;
+    SYSCALL3(__NR_futex, &th->run_status, FUTEX_WAKE_PRIVATE, 1);
+  }
 
-    if(ret) (*thread)->start_status = TB_START_EXIT;
-    else (*thread)->start_status = TB_START_OK;
-    SYSCALL3(__NR_futex, &(*thread)->start_status, FUTEX_WAKE, 1);
+  void *stack_top = th->stack + th->stack_size;
+  if(th->desc_placement == TBTHREAD_DESC_IN_STACK)
+    stack_top = th;
 
-    if(ret) {
-      wait_for_thread(*thread);
-      goto error;
-    }
+  asm volatile(
+    "movq %0, %%rsp\n\t"
+    "call *%1"
+    :
+    : "r" (stack_top), "r" (reservoir_run), "D" (th)
+    : "memory");
+  __builtin_unreachable();
+}
+
+//------------------------------------------------------------------------------
+// Hand the function over to a parked thread if there is one that matches
+// the attributes
+//------------------------------------------------------------------------------
+static int attr_compatible(const tbthread_attr_t *a, const tbthread_attr_t *b)
+{
+  if(a->stack_size != b->stack_size || a->desc_placement != b->desc_placement ||
+     a->sched_inherit != b->sched_inherit || a->affinity_set != b->affinity_set)
+    return 0;
+
+  if(!a->sched_inherit && (a->sched_policy != b->sched_policy ||
+                           a->sched_priority != b->sched_priority))
+    return 0;
+
+  if(a->affinity_set &&
+     memcmp(&a->affinity, &b->affinity, sizeof(tbthread_cpuset_t)))
+    return 0;
+  return 1;
+}
+
+static int reservoir_wake(
+  tbthread_t            *thread,
+  const tbthread_attr_t *attr,
+  void                  *(*f)(void *),
+  void                  *arg)
+{
+  if(!reservoir_desc.next || !attr_compatible(attr, &reservoir_attr))
+    return 0;
+
+  if(attr->sched_inherit &&
+     tbthread_self()->sched_info != reservoir_sched_info)
+    return 0;
+
+  tbthread_mutex_lock(&desc_mutex);
+  list_t *node = reservoir_desc.next;
+  if(!node) {
+    tbthread_mutex_unlock(&desc_mutex);
+    return 0;
+  }
+  list_rm(node);
+
+  tbthread_t th = (tbthread_t)node->element;
+  th->fn = f;
+  th->arg = arg;
+  th->retval = 0;
+  th->joiner = 0;
+  th->join_status = attr->joinable;
+  th->cancel_status = TB_CANCEL_ENABLED | TB_CANCEL_DEFERRED;
+  th->run_status = TB_RUN_RUNNING;
+  th->group = attr->group;
+  if(th->group)
+    ++th->group->running;
+  tbthread_mutex_unlock(&desc_mutex);
+
+  SYSCALL3(__NR_futex, &th->run_status, FUTEX_WAKE_PRIVATE, 1);
+  *thread = th;
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+// Start n threads that wait for work to be handed over by tbthread_create
+//------------------------------------------------------------------------------
+int tbthread_reservoir_init(int n, const tbthread_attr_t *attr)
+{
+  if(n <= 0)
+    return -EINVAL;
+
+  if(!__sync_bool_compare_and_swap(&reservoir_initialized, 0, 1))
+    return -EBUSY;
+
+  reservoir_attr = *attr;
+  reservoir_sched_info = tbthread_self()->sched_info;
+
+  //----------------------------------------------------------------------------
+  // Remember the CPU mask the threads start with, to restore it after every
+  // user function
+  //----------------------------------------------------------------------------
+  if(attr->affinity_set)
+    reservoir_affinity = attr->affinity;
+  else {
+    TBTHREAD_CPU_ZERO(&reservoir_affinity);
+    int ret = SYSCALL3(__NR_sched_getaffinity, 0, sizeof(tbthread_cpuset_t),
+                       &reservoir_affinity);
+    if(ret < 0)
+      return ret;
+  }
+
+  for(int i = 0; i < n; ++i) {
+    tbthread_t thread;
+    int ret = spawn_thread(&thread, attr, 0, 0, 1);
+    if(ret)
+      return ret;
+
+    tbthread_mutex_lock(&desc_mutex);
+    thread->join_status = TB_DETACHED;
+    list_add(&reservoir_desc, &thread->reservoir_node, 1);
+    tbthread_mutex_unlock(&desc_mutex);
   }
   return 0;
+}
 
-error:
-  tbmunmap(stack, attr->stack_size);
-  release_descriptor(*thread);
-  return ret;
+//------------------------------------------------------------------------------
+// Spawn a thread
+//------------------------------------------------------------------------------
+int tbthread_create(
+  tbthread_t            *thread,
+  const tbthread_attr_t *attr,
+  void                  *(*f)(void *),
+  void                  *arg)
+{
+  if(reservoir_wake(thread, attr, f, arg))
+    return 0;
+  return spawn_thread(thread, attr, f, arg, 0);
 }
 
 //------------------------------------------------------------------------------
@@ -334,12 +943,12 @@ int tbthread_detach(tbthread_t thread)
   int ret = 0;
 
   tbthread_mutex_lock(&desc_mutex);
-  if(!list_find_elem(&used_desc, thread)) {
+  if(!tb_find_descriptor(thread)) {
     ret = -ESRCH;
     goto exit;
   }
 
-  if(thread->join_status == TB_JOINABLE_FIXED) {
+  if(thread->join_status == TB_JOINABLE_FIXED || thread->joiner) {
     ret = -EINVAL;
     goto exit;
   }
@@ -351,9 +960,15 @@ exit:
 }
 
 //------------------------------------------------------------------------------
-// Join a thread
+// Join a thread. With TB_JOIN_TRY we only succeed if the thread is already
+// done, with TB_JOIN_TIMED we give up at abstime.
 //------------------------------------------------------------------------------
-int tbthread_join(tbthread_t thread, void **retval)
+#define TB_JOIN_WAIT  0
+#define TB_JOIN_TRY   1
+#define TB_JOIN_TIMED 2
+
+static int join_thread(tbthread_t thread, void **retval, int mode,
+                       const struct timespec *abstime)
 {
   tbthread_t self = tbthread_self();
   int ret = 0;
@@ -368,7 +983,7 @@ int tbthread_join(tbthread_t thread, void **retval)
     goto error;
   }
 
-  if(!list_find_elem(&used_desc, thread)) {
+  if(!tb_find_descriptor(thread)) {
     ret = -ESRCH;
     goto error;
   }
@@ -388,16 +1003,38 @@ int tbthread_join(tbthread_t thread, void **retval)
     goto error;
   }
 
-  thread->join_status = TB_JOINABLE_FIXED;
-  thread->joiner = self;
+  if(mode == TB_JOIN_TRY && !thread_done(thread)) {
+    ret = -EBUSY;
+    goto error;
+  }
 
   //----------------------------------------------------------------------------
-  // We can release the lock now, because we're responsible for releasing the
-  // thread descriptor now, so it's not going to go away.
+  // Nobody can detach the thread or take it from its group while we're its
+  // joiner. We can release the lock now, because we're responsible for
+  // releasing the thread descriptor, so it's not going to go away.
   //----------------------------------------------------------------------------
+  thread->joiner = self;
+  group_unlink(thread);
   tbthread_mutex_unlock(&desc_mutex);
 
-  wait_for_thread(thread);
+  ret = wait_for_thread(thread, mode == TB_JOIN_TIMED ? abstime : 0);
+
+  //----------------------------------------------------------------------------
+  // We have given up waiting. If the thread has got past the point in
+  // tbthread_exit where it looks at its joiner, it counts on us, so we finish
+  // the join; it's not going to take long. Otherwise, we stop being its
+  // joiner, so that it can be joined or detached again.
+  //----------------------------------------------------------------------------
+  if(ret) {
+    tbthread_mutex_lock(&desc_mutex);
+    if(thread->join_status != TB_JOINABLE_FIXED) {
+      thread->joiner = 0;
+      goto error;
+    }
+    tbthread_mutex_unlock(&desc_mutex);
+    wait_for_thread(thread, 0);
+  }
+
   if(retval)
     *retval = thread->retval;
   release_descriptor(thread);
@@ -408,6 +1045,31 @@ error:
   return ret;
 }
 
+//------------------------------------------------------------------------------
+// Join a thread
+//------------------------------------------------------------------------------
+int tbthread_join(tbthread_t thread, void **retval)
+{
+  return join_thread(thread, retval, TB_JOIN_WAIT, 0);
+}
+
+//------------------------------------------------------------------------------
+// Join a thread if it has already finished
+//------------------------------------------------------------------------------
+int tbthread_tryjoin(tbthread_t thread, void **retval)
+{
+  return join_thread(thread, retval, TB_JOIN_TRY, 0);
+}
+
+//------------------------------------------------------------------------------
+// Join a thread, give up at abstime on CLOCK_REALTIME
+//------------------------------------------------------------------------------
+int tbthread_timedjoin(tbthread_t thread, void **retval,
+                       const struct timespec *abstime)
+{
+  return join_thread(thread, retval, TB_JOIN_TIMED, abstime);
+}
+
 //------------------------------------------------------------------------------
 // Thread equal
 //------------------------------------------------------------------------------
@@ -416,6 +1078,86 @@ int tbthread_equal(tbthread_t t1, tbthread_t t2)
   return t1 == t2;
 }
 
+//------------------------------------------------------------------------------
+// Initialize a thread group
+//------------------------------------------------------------------------------
+void tbthread_group_init(tbthread_group_t *group)
+{
+  memset(group, 0, sizeof(tbthread_group_t));
+}
+
+//------------------------------------------------------------------------------
+// Wait until something happens to the group, must be called with desc_mutex
+// held
+//------------------------------------------------------------------------------
+static void group_wait(tbthread_group_t *group)
+{
+  uint32_t seq = group->seq;
+  tbthread_mutex_unlock(&desc_mutex);
+  SYSCALL3(__NR_futex, &group->seq, FUTEX_WAIT_PRIVATE, seq);
+  tbthread_mutex_lock(&desc_mutex);
+}
+
+//------------------------------------------------------------------------------
+// Take a finished member off the list, it has already been through
+// tbthread_exit, so we only need to wait for the kernel to let go of it
+//------------------------------------------------------------------------------
+static tbthread_t group_take(tbthread_group_t *group, void **retval)
+{
+  tbthread_t thread = (tbthread_t)group->done.next->element;
+  group_unlink(thread);
+  thread->joiner = tbthread_self();
+  tbthread_mutex_unlock(&desc_mutex);
+
+  wait_for_thread(thread, 0);
+  if(retval)
+    *retval = thread->retval;
+  release_descriptor(thread);
+  tbthread_mutex_lock(&desc_mutex);
+  return thread;
+}
+
+//------------------------------------------------------------------------------
+// Wait for all the members of the group to finish and join the ones that
+// nobody else is joining
+//------------------------------------------------------------------------------
+int tbthread_group_wait_all(tbthread_group_t *group)
+{
+  tbthread_mutex_lock(&desc_mutex);
+  while(group->running || group->done.next) {
+    if(group->done.next)
+      group_take(group, 0);
+    else
+      group_wait(group);
+  }
+  tbthread_mutex_unlock(&desc_mutex);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Join whichever joinable member of the group finishes first
+//------------------------------------------------------------------------------
+int tbthread_group_wait_any(tbthread_group_t *group, tbthread_t *thread,
+                            void **retval)
+{
+  int ret = 0;
+  tbthread_mutex_lock(&desc_mutex);
+  while(!group->done.next) {
+    if(!group->running) {
+      ret = -ECHILD;
+      goto exit;
+    }
+    group_wait(group);
+  }
+
+  tbthread_t th = group_take(group, retval);
+  if(thread)
+    *thread = th;
+exit:
+  tbthread_mutex_unlock(&desc_mutex);
+  return ret;
+}
+
 //------------------------------------------------------------------------------
 // Once cancel cleanup
 //------------------------------------------------------------------------------
@@ -423,7 +1165,7 @@ static void once_cleanup(void *arg)
 {
   tbthread_once_t *once = (tbthread_once_t *)arg;
   *once = TB_ONCE_NEW;
-  SYSCALL3(__NR_futex, once, FUTEX_WAKE, INT_MAX);
+  SYSCALL3(__NR_futex, once, FUTEX_WAKE_PRIVATE, INT_MAX);
 }
 
 //------------------------------------------------------------------------------
@@ -454,7 +1196,7 @@ int tbthread_once(tbthread_once_t *once, void (*func)(void))
       tbthread_cleanup_pop(0);
 
       *once = TB_ONCE_DONE;
-      SYSCALL3(__NR_futex, once, FUTEX_WAKE, INT_MAX);
+      SYSCALL3(__NR_futex, once, FUTEX_WAKE_PRIVATE, INT_MAX);
       tbthread_setcancelstate(cancel_state, 0);
       return 0;
     }
@@ -465,7 +1207,7 @@ int tbthread_once(tbthread_once_t *once, void (*func)(void))
     // The waiters
     //--------------------------------------------------------------------------
     while(1) {
-      SYSCALL3(__NR_futex, once, FUTEX_WAIT, TB_ONCE_IN_PROGRESS);
+      SYSCALL3(__NR_futex, once, FUTEX_WAIT_PRIVATE, TB_ONCE_IN_PROGRESS);
       if(*once != TB_ONCE_IN_PROGRESS)
         break;
     }
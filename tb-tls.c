@@ -19,16 +19,6 @@
 
 #include "tb.h"
 
-//------------------------------------------------------------------------------
-// Get the pointer of the currently running thread
-//------------------------------------------------------------------------------
-tbthread_t tbthread_self()
-{
-  tbthread_t self;
-  asm("movq %%fs:0, %0\n\t" : "=r" (self));
-  return self;
-}
-
 //------------------------------------------------------------------------------
 // The keys and helpers
 //------------------------------------------------------------------------------
@@ -42,6 +32,26 @@ static struct
 #define KEY_ACQUIRE(k) (__sync_bool_compare_and_swap(&(keys[k].seq), keys[k].seq, keys[k].seq+1))
 #define KEY_RELEASE(k) (__sync_bool_compare_and_swap(&(keys[k].seq), keys[k].seq, keys[k].seq+1))
 
+//------------------------------------------------------------------------------
+// Find the slot of the key in the thread's storage, allocating its block if
+// needed and requested
+//------------------------------------------------------------------------------
+static tb_tls_slot_t *get_slot(tbthread_t th, tbthread_key_t key, int alloc)
+{
+  if(key < TBTHREAD_TLS_BLOCK)
+    return &th->tls[key];
+
+  tb_tls_slot_t **block = &th->tls_blocks[key/TBTHREAD_TLS_BLOCK-1];
+  if(!*block) {
+    if(!alloc)
+      return 0;
+    *block = calloc(TBTHREAD_TLS_BLOCK, sizeof(tb_tls_slot_t));
+    if(!*block)
+      return 0;
+  }
+  return &(*block)[key%TBTHREAD_TLS_BLOCK];
+}
+
 //------------------------------------------------------------------------------
 // Create a key
 //------------------------------------------------------------------------------
@@ -79,9 +89,9 @@ void *tbthread_getspecific(tbthread_key_t key)
   if(key >= TBTHREAD_MAX_KEYS || KEY_UNUSED(key))
     return 0;
 
-  tbthread_t self = tbthread_self();
-  if(self->tls[key].seq == keys[key].seq)
-    return self->tls[key].data;
+  tb_tls_slot_t *slot = get_slot(tbthread_self(), key, 0);
+  if(slot && slot->seq == keys[key].seq)
+    return slot->data;
   return 0;
 }
 
@@ -93,9 +103,11 @@ int tbthread_setspecific(tbthread_key_t key, void *value)
   if(key >= TBTHREAD_MAX_KEYS || KEY_UNUSED(key))
     return -EINVAL;
 
-  tbthread_t self = tbthread_self();
-  self->tls[key].seq = keys[key].seq;
-  self->tls[key].data = value;
+  tb_tls_slot_t *slot = get_slot(tbthread_self(), key, value != 0);
+  if(!slot)
+    return value ? -ENOMEM : 0;
+  slot->seq = keys[key].seq;
+  slot->data = value;
   return 0;
 }
 
@@ -106,11 +118,28 @@ void tb_tls_call_destructors()
 {
   tbthread_t self = tbthread_self();
   for(tbthread_key_t i = 0; i < TBTHREAD_MAX_KEYS; ++i) {
-    if(!KEY_UNUSED(i) && self->tls[i].seq == keys[i].seq &&
-       self->tls[i].data && keys[i].destructor) {
-       void *data = self->tls[i].data;
-       self->tls[i].data = 0;
+    tb_tls_slot_t *slot = get_slot(self, i, 0);
+    if(!slot) {
+      i += TBTHREAD_TLS_BLOCK-1;
+      continue;
+    }
+    if(!KEY_UNUSED(i) && slot->seq == keys[i].seq &&
+       slot->data && keys[i].destructor) {
+       void *data = slot->data;
+       slot->data = 0;
        keys[i].destructor(data);
      }
    }
 }
+
+//------------------------------------------------------------------------------
+// Free the dynamically allocated TLS blocks of the current thread
+//------------------------------------------------------------------------------
+void tb_tls_free_blocks()
+{
+  tbthread_t self = tbthread_self();
+  for(int i = 0; i < TBTHREAD_TLS_BLOCKS-1; ++i) {
+    free(self->tls_blocks[i]);
+    self->tls_blocks[i] = 0;
+  }
+}
@@ -21,6 +21,7 @@
 #include "tb-private.h"
 
 #include <linux/time.h>
+#include <linux/mman.h>
 #include <asm-generic/param.h>
 #include <string.h>
 #include <stdarg.h>
@@ -205,6 +206,23 @@ int tbmunmap(void *addr, unsigned long length)
   return SYSCALL2(__NR_munmap, addr, length);
 }
 
+//------------------------------------------------------------------------------
+// Mremap
+//------------------------------------------------------------------------------
+void *tbmremap(void *addr, unsigned long old_length, unsigned long new_length,
+  int flags)
+{
+  return (void *)SYSCALL4(__NR_mremap, addr, old_length, new_length, flags);
+}
+
+//------------------------------------------------------------------------------
+// Madvise
+//------------------------------------------------------------------------------
+int tbmadvise(void *addr, unsigned long length, int advice)
+{
+  return SYSCALL3(__NR_madvise, addr, length, advice);
+}
+
 //------------------------------------------------------------------------------
 // Brk
 //------------------------------------------------------------------------------
@@ -216,99 +234,847 @@ void *tbbrk(void *addr)
 //------------------------------------------------------------------------------
 // Malloc helper structs
 //------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+// The chunks are laid out back to back between heap_start and heap_limit.
+// Every header holds the size of the previous chunk as a boundary tag, so that
+// we can find both neighbours of a chunk and merge the free ones.
+//------------------------------------------------------------------------------
 typedef struct memchunk
 {
-  struct memchunk *next;
-  uint64_t         size;
+  uint64_t prev_size;
+  uint64_t size;
 } memchunk_t;
 
-static memchunk_t  head;
+static memchunk_t *heap_start;
+static memchunk_t *tail;
 static void       *heap_limit;
-#define MEMCHUNK_USED 0x4000000000000000
+#define MEMCHUNK_USED    0x4000000000000000
+#define MEMCHUNK_MMAPPED 0x2000000000000000
+#define MEMCHUNK_ZERO    0x1000000000000000
+#define MEMCHUNK_FLAGS   (MEMCHUNK_USED | MEMCHUNK_MMAPPED | MEMCHUNK_ZERO)
+
+#define MEMCHUNK_OWNER_SHIFT 48
+#define MEMCHUNK_OWNER       (0xfffULL << MEMCHUNK_OWNER_SHIFT)
 
 //------------------------------------------------------------------------------
-// Malloc
+// The memory between heap_clean and heap_limit has never been handed out, so
+// it still holds the zeros the kernel gave us, save for the headers and the
+// bin links of the free chunks. Chunks allocated from there are marked with
+// MEMCHUNK_ZERO, and so are the fresh mappings.
+//------------------------------------------------------------------------------
+static void       *heap_clean;
+
+#define CHUNK_SIZE(chunk) ((chunk)->size & ~(MEMCHUNK_FLAGS | MEMCHUNK_OWNER))
+#define CHUNK_USED(chunk) ((chunk)->size & MEMCHUNK_USED)
+#define CHUNK_OWNER(chunk) \
+  (((chunk)->size & MEMCHUNK_OWNER) >> MEMCHUNK_OWNER_SHIFT)
+#define CHUNK_NEXT(chunk) \
+  ((memchunk_t *)((char *)(chunk)+sizeof(memchunk_t)+CHUNK_SIZE(chunk)))
+#define CHUNK_PREV(chunk) \
+  ((memchunk_t *)((char *)(chunk)-sizeof(memchunk_t)-(chunk)->prev_size))
+
+//------------------------------------------------------------------------------
+// Update the boundary tag of the next chunk after the size of this one changed
+//------------------------------------------------------------------------------
+static void chunk_set_size(memchunk_t *chunk, uint64_t size)
+{
+  chunk->size = size;
+  if(chunk != tail)
+    CHUNK_NEXT(chunk)->prev_size = CHUNK_SIZE(chunk);
+}
+
+//------------------------------------------------------------------------------
+// Free chunks are kept in segregated lists, one per size class. The links live
+// in the payload, which is always at least 16 bytes long. Chunks smaller than
+// BIN_SMALL_MAX have a bin for every size. Larger chunks are binned by the
+// position of their highest bit and the BIN_SUB_BITS bits that follow. A bitmap
+// tells which bins are non-empty, so finding a fit never depends on the number
+// of chunks. Everything from 2^BIN_LARGE_MAX_LOG bytes up shares the last bin.
+//------------------------------------------------------------------------------
+typedef struct memlinks
+{
+  memchunk_t *next;
+  memchunk_t *prev;
+} memlinks_t;
+
+#define CHUNK_LINKS(chunk) ((memlinks_t *)((char *)(chunk)+sizeof(memchunk_t)))
+
+#define BIN_SMALL_MAX     512
+#define BIN_SMALL_NUM     (BIN_SMALL_MAX >> 3)
+#define BIN_SUB_BITS      3
+#define BIN_SUB_NUM       (1 << BIN_SUB_BITS)
+#define BIN_LARGE_MIN_LOG 9
+#define BIN_LARGE_MAX_LOG 47
+#define BIN_NUM           (BIN_SMALL_NUM + \
+  (BIN_LARGE_MAX_LOG - BIN_LARGE_MIN_LOG + 1) * BIN_SUB_NUM)
+#define BIN_MAP_WORDS     ((BIN_NUM+63) >> 6)
+
+static memchunk_t *bins[BIN_NUM];
+static uint64_t    bin_map[BIN_MAP_WORDS];
+
+static int bin_index(uint64_t size)
+{
+  if(size < BIN_SMALL_MAX)
+    return size >> 3;
+  int fl = 63 - __builtin_clzll(size);
+  if(fl > BIN_LARGE_MAX_LOG)
+    return BIN_NUM - 1;
+  int sl = (size >> (fl - BIN_SUB_BITS)) & (BIN_SUB_NUM - 1);
+  return BIN_SMALL_NUM + (fl - BIN_LARGE_MIN_LOG) * BIN_SUB_NUM + sl;
+}
+
+static void bin_insert(memchunk_t *chunk)
+{
+  int idx = bin_index(chunk->size);
+  memlinks_t *links = CHUNK_LINKS(chunk);
+  links->prev = 0;
+  links->next = bins[idx];
+  if(bins[idx])
+    CHUNK_LINKS(bins[idx])->prev = chunk;
+  bins[idx] = chunk;
+  bin_map[idx >> 6] |= 1ULL << (idx & 63);
+}
+
+static void bin_remove(memchunk_t *chunk)
+{
+  int idx = bin_index(chunk->size);
+  memlinks_t *links = CHUNK_LINKS(chunk);
+  if(links->prev)
+    CHUNK_LINKS(links->prev)->next = links->next;
+  else
+    bins[idx] = links->next;
+  if(links->next)
+    CHUNK_LINKS(links->next)->prev = links->prev;
+  if(!bins[idx])
+    bin_map[idx >> 6] &= ~(1ULL << (idx & 63));
+}
+
+//------------------------------------------------------------------------------
+// Find a free chunk of at least the given size. All the chunks in the bins
+// above the one of the requested size are big enough, the ones in the same bin
+// may not be. We look at the first BIN_SEARCH_MAX of those before going up,
+// and at the rest of them only if there is nothing above, which beats growing
+// the heap.
+//------------------------------------------------------------------------------
+#define BIN_SEARCH_MAX 8
+
+static memchunk_t *bin_find_above(int idx)
+{
+  ++idx;
+  int word = idx >> 6;
+  if(word >= BIN_MAP_WORDS)
+    return 0;
+  uint64_t bits = bin_map[word] & (~0ULL << (idx & 63));
+  while(!bits) {
+    if(++word == BIN_MAP_WORDS)
+      return 0;
+    bits = bin_map[word];
+  }
+  return bins[(word << 6) + __builtin_ctzll(bits)];
+}
+
+static memchunk_t *bin_find(uint64_t size)
+{
+  int idx = bin_index(size);
+  memchunk_t *chunk = bins[idx];
+  for(int i = 0; chunk && i < BIN_SEARCH_MAX; ++i) {
+    if(chunk->size >= size)
+      return chunk;
+    chunk = CHUNK_LINKS(chunk)->next;
+  }
+
+  memchunk_t *above = bin_find_above(idx);
+  if(above)
+    return above;
+
+  for(; chunk; chunk = CHUNK_LINKS(chunk)->next)
+    if(chunk->size >= size)
+      return chunk;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// The header and the bin links of a free chunk that gets merged into its
+// neighbour become a part of the payload, so they need to be cleared if they
+// lie in the clean part of the heap
+//------------------------------------------------------------------------------
+static void chunk_dissolve(memchunk_t *chunk)
+{
+  if((void *)(CHUNK_LINKS(chunk)+1) > heap_clean)
+    memset(chunk, 0, sizeof(memchunk_t)+sizeof(memlinks_t));
+}
+
+//------------------------------------------------------------------------------
+// Lock the heap
 //------------------------------------------------------------------------------
 static int memory_lock;
-void *malloc(size_t size)
+static uint16_t memory_lock_spins;
+static void memory_lock_acquire()
 {
-  tb_futex_lock(&memory_lock);
+  tb_futex_lock_adaptive(&memory_lock, &memory_lock_spins,
+                         TBTHREAD_PROCESS_PRIVATE);
+}
+
+//------------------------------------------------------------------------------
+// Get more memory from the system. If the last chunk of the heap is free, we
+// grow it, otherwise we add a new one. Needs to be called with the memory lock
+// held.
+//------------------------------------------------------------------------------
+static memchunk_t *heap_grow(size_t alloc_size)
+{
+  //----------------------------------------------------------------------------
+  // We have been called for the first time and don't know the heap limit yet.
+  // On Linux, the brk syscall will return the previous heap limit on error.
+  // We try to set the heap limit at 0, which is obviously wrong, so that we
+  // could figure out what the current heap limit is.
+  //----------------------------------------------------------------------------
+  if(!heap_limit) {
+    heap_limit = tbbrk(0);
+    heap_start = heap_limit;
+    heap_clean = heap_limit;
+  }
+
+  memchunk_t *last = 0;
+  size_t      needed = alloc_size+sizeof(memchunk_t);
+  if(tail && !CHUNK_USED(tail)) {
+    last = tail;
+    if(CHUNK_SIZE(last) >= alloc_size) {
+      bin_remove(last);
+      return last;
+    }
+    needed = alloc_size - CHUNK_SIZE(last);
+  }
 
   //----------------------------------------------------------------------------
-  // Allocating anything less than 16 bytes is kind of pointless, the
-  // book-keeping overhead is too big. We will also align to 8 bytes.
+  // We will allocate at least one page at a time
   //----------------------------------------------------------------------------
+  size_t chunk_size = (needed-1)/EXEC_PAGESIZE;
+  chunk_size *= EXEC_PAGESIZE;
+  chunk_size += EXEC_PAGESIZE;
+
+  void     *new_heap_limit = tbbrk((char*)heap_limit + chunk_size);
+  uint64_t  new_chunk_size = (char *)new_heap_limit - (char *)heap_limit;
+
+  if(new_chunk_size < chunk_size)
+    return 0;
+
+  if(last) {
+    bin_remove(last);
+    last->size += new_chunk_size;
+  }
+  else {
+    last = heap_limit;
+    last->prev_size = tail ? CHUNK_SIZE(tail) : 0;
+    last->size      = new_chunk_size-sizeof(memchunk_t);
+    tail            = last;
+  }
+  heap_limit = new_heap_limit;
+  return last;
+}
+
+//------------------------------------------------------------------------------
+// Give memory back to the system. The free chunk at the top of the heap is
+// shrunk by lowering the heap limit, leaving it with at least pad bytes. The
+// pages of the large free chunks in the middle of the heap are dropped with
+// madvise, except for the first one holding the bin links. Returns 1 if any
+// memory was released. Needs to be called with the memory lock held.
+//------------------------------------------------------------------------------
+static size_t trim_threshold = 128*1024;
+
+static int heap_trim(size_t pad, int interior)
+{
+  int released = 0;
+  if(tail && !CHUNK_USED(tail) && tail->size > pad + 16) {
+    size_t release = (tail->size - pad - 16) / EXEC_PAGESIZE * EXEC_PAGESIZE;
+    void  *new_heap_limit = (char *)heap_limit - release;
+    if(release && tbbrk(new_heap_limit) == new_heap_limit) {
+      bin_remove(tail);
+      tail->size -= release;
+      heap_limit = new_heap_limit;
+      if(heap_clean > heap_limit)
+        heap_clean = heap_limit;
+      bin_insert(tail);
+      released = 1;
+    }
+  }
+
+  if(!interior)
+    return released;
+
+  for(int idx = bin_index(2*EXEC_PAGESIZE); idx < BIN_NUM; ++idx) {
+    memchunk_t *chunk;
+    for(chunk = bins[idx]; chunk; chunk = CHUNK_LINKS(chunk)->next) {
+      uint64_t start = (uint64_t)(CHUNK_LINKS(chunk)+1);
+      uint64_t end   = (uint64_t)CHUNK_NEXT(chunk);
+      start = (start+EXEC_PAGESIZE-1) & ~(uint64_t)(EXEC_PAGESIZE-1);
+      end &= ~(uint64_t)(EXEC_PAGESIZE-1);
+      if(end > start && !tbmadvise((void *)start, end-start, MADV_DONTNEED))
+        released = 1;
+    }
+  }
+  return released;
+}
+
+//------------------------------------------------------------------------------
+// Allocating anything less than 16 bytes is kind of pointless, the
+// book-keeping overhead is too big. We will also align to 8 bytes.
+//------------------------------------------------------------------------------
+static size_t heap_alloc_size(size_t size)
+{
   size_t alloc_size = (((size-1)>>3)<<3)+8;
   if(alloc_size < 16)
     alloc_size = 16;
+  return alloc_size;
+}
+
+//------------------------------------------------------------------------------
+// Allocate a chunk from the heap, needs to be called with the memory lock held
+//------------------------------------------------------------------------------
+static void *heap_alloc(size_t size)
+{
+  size_t alloc_size = heap_alloc_size(size);
 
   //----------------------------------------------------------------------------
-  // Try to find a suitable chunk that is unused
+  // Try to find a suitable chunk that is unused, ask Linux for more memory if
+  // there is none
   //----------------------------------------------------------------------------
-  memchunk_t *cursor = &head;
-  memchunk_t *chunk  = 0;
-  while(cursor->next) {
-    chunk = cursor->next;
-    if(!(chunk->size & MEMCHUNK_USED) && chunk->size >= alloc_size)
-      break;
-    cursor = cursor->next;
+  memchunk_t *chunk = bin_find(alloc_size);
+  if(chunk)
+    bin_remove(chunk);
+  else {
+    chunk = heap_grow(alloc_size);
+    if(!chunk)
+      return 0;
   }
 
   //----------------------------------------------------------------------------
-  // No chunk found, ask Linux for more memory
+  // Split the chunk if it's big enough to contain one more header and at least
+  // 16 more bytes
   //----------------------------------------------------------------------------
-  if (!cursor->next) {
-    //--------------------------------------------------------------------------
-    // We have been called for the first time and don't know the heap limit yet.
-    // On Linux, the brk syscall will return the previous heap limit on error.
-    // We try to set the heap limit at 0, which is obviously wrong, so that we
-    // could figure out what the current heap limit is.
-    //--------------------------------------------------------------------------
-    if(!heap_limit)
-      heap_limit = tbbrk(0);
+  if(chunk->size > alloc_size + sizeof(memchunk_t) + 16)
+  {
+    memchunk_t *new_chunk = (memchunk_t *)((char *)chunk+sizeof(memchunk_t)+alloc_size);
+    new_chunk->prev_size = alloc_size;
+    new_chunk->size = chunk->size-alloc_size-sizeof(memchunk_t);
+    chunk->size = alloc_size;
+    if(tail == chunk)
+      tail = new_chunk;
+    chunk_set_size(new_chunk, new_chunk->size);
+    bin_insert(new_chunk);
+  }
+
+  //----------------------------------------------------------------------------
+  // Mark the chunk as used and return the memory
+  //----------------------------------------------------------------------------
+  chunk->size |= MEMCHUNK_USED;
+  if((void *)(CHUNK_LINKS(chunk)+1) >= heap_clean)
+    chunk->size |= MEMCHUNK_ZERO;
+  if((void *)CHUNK_NEXT(chunk) > heap_clean)
+    heap_clean = CHUNK_NEXT(chunk);
+  return (char*)chunk+sizeof(memchunk_t);
+}
+
+//------------------------------------------------------------------------------
+// Return a chunk to the heap and merge it with its free neighbours, needs to
+// be called with the memory lock held
+//------------------------------------------------------------------------------
+static void heap_free(void *ptr)
+{
+  memchunk_t *chunk = (memchunk_t *)((char *)ptr-sizeof(memchunk_t));
+  chunk->size = CHUNK_SIZE(chunk);
+
+  if(chunk != tail) {
+    memchunk_t *next = CHUNK_NEXT(chunk);
+    if(!CHUNK_USED(next)) {
+      bin_remove(next);
+      if(tail == next)
+        tail = chunk;
+      chunk->size += sizeof(memchunk_t) + next->size;
+      chunk_dissolve(next);
+    }
+  }
+
+  if(chunk != heap_start) {
+    memchunk_t *prev = CHUNK_PREV(chunk);
+    if(!CHUNK_USED(prev)) {
+      bin_remove(prev);
+      if(tail == chunk)
+        tail = prev;
+      prev->size += sizeof(memchunk_t) + chunk->size;
+      chunk = prev;
+    }
+  }
+
+  chunk_set_size(chunk, chunk->size);
+  bin_insert(chunk);
+
+  if(chunk == tail && chunk->size >= trim_threshold)
+    heap_trim(0, 0);
+}
+
+//------------------------------------------------------------------------------
+// Cut a used chunk down to alloc_size bytes and give the rest back to the heap,
+// if it's big enough to contain one more header and at least 16 more bytes.
+// Needs to be called with the memory lock held.
+//------------------------------------------------------------------------------
+static void heap_shrink(memchunk_t *chunk, size_t alloc_size)
+{
+  size_t size = CHUNK_SIZE(chunk);
+  if(size <= alloc_size + sizeof(memchunk_t) + 16)
+    return;
+
+  memchunk_t *new_chunk;
+  new_chunk = (memchunk_t *)((char *)chunk+sizeof(memchunk_t)+alloc_size);
+  new_chunk->prev_size = alloc_size;
+  new_chunk->size = (size-alloc_size-sizeof(memchunk_t)) | MEMCHUNK_USED;
+  chunk->size = alloc_size | (chunk->size & MEMCHUNK_FLAGS);
+  if(tail == chunk)
+    tail = new_chunk;
+  heap_free((char *)new_chunk+sizeof(memchunk_t));
+}
+
+//------------------------------------------------------------------------------
+// Allocate a chunk with an aligned payload. We take a chunk big enough to cut
+// a free chunk off its front, so that the rest starts at an aligned address.
+// Needs to be called with the memory lock held.
+//------------------------------------------------------------------------------
+static void *heap_alloc_aligned(size_t size, size_t alignment)
+{
+  size_t  alloc_size = heap_alloc_size(size);
+  char   *ptr = heap_alloc(alloc_size + alignment + sizeof(memchunk_t) + 16);
+  if(!ptr)
+    return 0;
+
+  memchunk_t *chunk = (memchunk_t *)(ptr-sizeof(memchunk_t));
+  if((uint64_t)ptr & (alignment - 1)) {
+    uint64_t aligned = (uint64_t)ptr + sizeof(memchunk_t) + 16 + alignment - 1;
+    aligned &= ~(uint64_t)(alignment - 1);
+    uint64_t lead = aligned - sizeof(memchunk_t) - (uint64_t)ptr;
 
     //--------------------------------------------------------------------------
-    // We will allocate at least one page at a time
+    // The new payload lies past the bin links of the old one, so it stays
+    // zero if the old one was
     //--------------------------------------------------------------------------
-    size_t chunk_size = (size+sizeof(memchunk_t)-1)/EXEC_PAGESIZE;
+    memchunk_t *new_chunk = (memchunk_t *)(aligned - sizeof(memchunk_t));
+    new_chunk->prev_size = lead;
+    new_chunk->size = CHUNK_SIZE(chunk) - lead - sizeof(memchunk_t);
+    new_chunk->size |= chunk->size & (MEMCHUNK_USED | MEMCHUNK_ZERO);
+    chunk->size = lead | MEMCHUNK_USED;
+    if(tail == chunk)
+      tail = new_chunk;
+    chunk_set_size(new_chunk, new_chunk->size);
+    heap_free(ptr);
+    chunk = new_chunk;
+  }
+
+  heap_shrink(chunk, alloc_size);
+  return (char *)chunk+sizeof(memchunk_t);
+}
+
+//------------------------------------------------------------------------------
+// Resize a used chunk without moving it. The chunk grows by absorbing the free
+// chunk that follows it, and by moving the heap limit if it's the last one.
+// Returns 1 on success. Needs to be called with the memory lock held.
+//------------------------------------------------------------------------------
+static int heap_resize(memchunk_t *chunk, size_t size)
+{
+  size_t alloc_size = heap_alloc_size(size);
+
+  if(alloc_size > CHUNK_SIZE(chunk) && chunk != tail) {
+    memchunk_t *next = CHUNK_NEXT(chunk);
+    size_t      merged = CHUNK_SIZE(chunk) + sizeof(memchunk_t) + next->size;
+    if(!CHUNK_USED(next) && (merged >= alloc_size || next == tail)) {
+      bin_remove(next);
+      if(tail == next)
+        tail = chunk;
+      chunk_set_size(chunk, merged | MEMCHUNK_USED);
+      chunk_dissolve(next);
+    }
+  }
+
+  if(alloc_size > CHUNK_SIZE(chunk) && chunk == tail) {
+    size_t chunk_size = (alloc_size - CHUNK_SIZE(chunk) - 1)/EXEC_PAGESIZE;
     chunk_size *= EXEC_PAGESIZE;
     chunk_size += EXEC_PAGESIZE;
 
     void     *new_heap_limit = tbbrk((char*)heap_limit + chunk_size);
     uint64_t  new_chunk_size = (char *)new_heap_limit - (char *)heap_limit;
+    if(new_chunk_size < chunk_size)
+      return 0;
+    chunk->size += new_chunk_size;
+    heap_limit = new_heap_limit;
+  }
+
+  if(alloc_size > CHUNK_SIZE(chunk))
+    return 0;
+
+  if((void *)CHUNK_NEXT(chunk) > heap_clean)
+    heap_clean = CHUNK_NEXT(chunk);
+  heap_shrink(chunk, alloc_size);
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+// Allocations above the threshold are served directly by mmap and given back
+// to the system on free. The chunk header sits at the beginning of the mapping,
+// or further in if the payload needs to be aligned, and the chunk spans the
+// rest of it. The prev_size field holds the offset of the header. Sizes that
+// cannot be rounded up to whole pages get a zero length.
+//------------------------------------------------------------------------------
+static size_t mmap_threshold = 128*1024;
+
+static size_t mmap_length(size_t size)
+{
+  if(size > SIZE_MAX - sizeof(memchunk_t) - EXEC_PAGESIZE)
+    return 0;
+  size_t length = (size+sizeof(memchunk_t)-1)/EXEC_PAGESIZE;
+  return (length+1)*EXEC_PAGESIZE;
+}
+
+static void *mmap_alloc(size_t size, size_t alignment)
+{
+  if(alignment > sizeof(memchunk_t) &&
+     __builtin_add_overflow(size, alignment, &size))
+    return 0;
+
+  size_t  length = mmap_length(size);
+  if(!length)
+    return 0;
+
+  char   *map = tbmmap(NULL, length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if((long)map < 0)
+    return 0;
+
+  uint64_t offset = 0;
+  if(alignment > sizeof(memchunk_t)) {
+    uint64_t payload = (uint64_t)map + sizeof(memchunk_t) + alignment - 1;
+    payload &= ~(uint64_t)(alignment - 1);
+    offset = payload - sizeof(memchunk_t) - (uint64_t)map;
+  }
+
+  memchunk_t *chunk = (memchunk_t *)(map + offset);
+  chunk->prev_size = offset;
+  chunk->size = (length-offset-sizeof(memchunk_t)) | MEMCHUNK_FLAGS;
+  return (char*)chunk+sizeof(memchunk_t);
+}
+
+static void mmap_free(memchunk_t *chunk)
+{
+  tbmunmap((char *)chunk - chunk->prev_size,
+           chunk->prev_size + CHUNK_SIZE(chunk) + sizeof(memchunk_t));
+}
+
+//------------------------------------------------------------------------------
+// Thread caches. Small blocks are kept in per-thread lists of size classes
+// 16 bytes apart, so that most of the allocations and frees don't need to
+// touch the memory lock. The lists are refilled from the heap and flushed back
+// to it in batches. The blocks in the caches are marked as used in the heap.
+//------------------------------------------------------------------------------
+#define CACHE_CLASS_SIZE 16
+#define CACHE_MAX_SIZE   (TBTHREAD_MALLOC_CLASSES*CACHE_CLASS_SIZE)
+#define CACHE_BATCH      8
+#define CACHE_MAX_COUNT  32
+
+//------------------------------------------------------------------------------
+// The blocks taken into a thread cache are tagged with the owner slot of the
+// thread. Other threads give them back with a lock-free push to the remote
+// list of the slot, and the owner moves them to its cache when it runs out of
+// blocks. A thread takes a slot when it first refills its cache and gives it
+// back when it drains the cache. Draining closes the remote list, so the
+// threads freeing the blocks after that keep them in their own caches instead.
+//------------------------------------------------------------------------------
+#define OWNER_SLOTS  (MEMCHUNK_OWNER >> MEMCHUNK_OWNER_SHIFT)
+#define OWNER_NONE   0xffff
+#define OWNER_CLOSED ((void *)1)
+
+static struct
+{
+  tbthread_t  owner;
+  void       *remote;
+} owner_slots[OWNER_SLOTS+1];
+static uint32_t owner_hint;
+
+static uint16_t owner_acquire(tbthread_t self)
+{
+  for(uint32_t i = 0; i < OWNER_SLOTS; ++i) {
+    uint32_t slot = (owner_hint + i) % OWNER_SLOTS + 1;
+    if(!owner_slots[slot].owner &&
+       __sync_bool_compare_and_swap(&owner_slots[slot].owner, 0, self)) {
+      owner_slots[slot].remote = 0;
+      owner_hint = slot;
+      return slot;
+    }
+  }
+  return OWNER_NONE;
+}
 
-    if(heap_limit == new_heap_limit)
-    {
-      tb_futex_unlock(&memory_lock);
+static int owner_push_remote(uint16_t slot, void *ptr)
+{
+  void *head;
+  do {
+    head = owner_slots[slot].remote;
+    if(head == OWNER_CLOSED)
       return 0;
+    *(void **)ptr = head;
+  } while(!__sync_bool_compare_and_swap(&owner_slots[slot].remote, head, ptr));
+  return 1;
+}
+
+static void *owner_take_remote(uint16_t slot, void *replacement)
+{
+  return __sync_lock_test_and_set(&owner_slots[slot].remote, replacement);
+}
+
+static void cache_refill(tbthread_t self, int cls)
+{
+  if(!self->malloc_owner)
+    self->malloc_owner = owner_acquire(self);
+  uint64_t tag = 0;
+  if(self->malloc_owner != OWNER_NONE)
+    tag = (uint64_t)self->malloc_owner << MEMCHUNK_OWNER_SHIFT;
+
+  memory_lock_acquire();
+  for(int i = 0; i < CACHE_BATCH; ++i) {
+    void *ptr = heap_alloc((cls+1)*CACHE_CLASS_SIZE);
+    if(!ptr)
+      break;
+    ((memchunk_t *)ptr-1)->size |= tag;
+    *(void **)ptr = self->malloc_cache[cls].head;
+    self->malloc_cache[cls].head = ptr;
+    ++self->malloc_cache[cls].count;
+  }
+  tb_futex_unlock(&memory_lock);
+}
+
+static void cache_flush(tbthread_t self, int cls, uint32_t keep)
+{
+  memory_lock_acquire();
+  while(self->malloc_cache[cls].count > keep) {
+    void *ptr = self->malloc_cache[cls].head;
+    self->malloc_cache[cls].head = *(void **)ptr;
+    --self->malloc_cache[cls].count;
+    heap_free(ptr);
+  }
+  tb_futex_unlock(&memory_lock);
+}
+
+//------------------------------------------------------------------------------
+// Put a block in the thread cache, the class is rounded down, so that all the
+// blocks in a list are at least as big as the class size
+//------------------------------------------------------------------------------
+static void cache_put(tbthread_t self, void *ptr, uint64_t size)
+{
+  int cls = size/CACHE_CLASS_SIZE - 1;
+  *(void **)ptr = self->malloc_cache[cls].head;
+  self->malloc_cache[cls].head = ptr;
+  ++self->malloc_cache[cls].count;
+  if(self->malloc_cache[cls].count > CACHE_MAX_COUNT)
+    cache_flush(self, cls, CACHE_MAX_COUNT/2);
+}
+
+//------------------------------------------------------------------------------
+// Move the blocks freed by other threads to the thread cache
+//------------------------------------------------------------------------------
+static void cache_take_remote(tbthread_t self)
+{
+  if(!self->malloc_owner || self->malloc_owner == OWNER_NONE)
+    return;
+  void *ptr = owner_take_remote(self->malloc_owner, 0);
+  while(ptr) {
+    void *next = *(void **)ptr;
+    cache_put(self, ptr, CHUNK_SIZE((memchunk_t *)ptr-1));
+    ptr = next;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Give all the cached blocks of the current thread back to the heap, together
+// with its owner slot
+//------------------------------------------------------------------------------
+void tb_malloc_cache_drain()
+{
+  if(!tb_threads_initialized)
+    return;
+  tbthread_t self = tbthread_self();
+
+  if(self->malloc_owner && self->malloc_owner != OWNER_NONE) {
+    void *ptr = owner_take_remote(self->malloc_owner, OWNER_CLOSED);
+    __sync_lock_release(&owner_slots[self->malloc_owner].owner);
+    self->malloc_owner = 0;
+    memory_lock_acquire();
+    while(ptr) {
+      void *next = *(void **)ptr;
+      heap_free(ptr);
+      ptr = next;
     }
+    tb_futex_unlock(&memory_lock);
+  }
 
-    cursor->next = heap_limit;
-    chunk        = cursor->next;
-    chunk->size  = new_chunk_size-sizeof(memchunk_t);
-    chunk->next  = 0;
-    heap_limit   = new_heap_limit;
+  for(int i = 0; i < TBTHREAD_MALLOC_CLASSES; ++i)
+    if(self->malloc_cache[i].count)
+      cache_flush(self, i, 0);
+}
+
+//------------------------------------------------------------------------------
+// Per-CPU arenas. In this mode, the small blocks are kept in per-CPU stacks of
+// the same size classes as the thread caches, and the threads registered for
+// restartable sequences use them instead of their own caches. The stacks are
+// only ever changed by the restartable sequences running on their CPU, so
+// neither side needs atomics or locks. The mapping is sized for
+// PERCPU_MAX_CPUS but only the pages of the CPUs we run on get touched.
+//------------------------------------------------------------------------------
+#define PERCPU_SLOTS    31
+#define PERCPU_MAX_CPUS 1024
+
+typedef struct
+{
+  uint64_t  count;
+  void     *slots[PERCPU_SLOTS];
+} percpu_stack_t;
+
+typedef struct
+{
+  percpu_stack_t cls[TBTHREAD_MALLOC_CLASSES];
+} percpu_arena_t;
+
+static percpu_arena_t *percpu_arenas;
+static percpu_arena_t *percpu_mem;
+
+static int percpu_push(tbthread_t self, percpu_arena_t *arenas, int cls,
+  void *ptr)
+{
+  return tb_rseq_push(self->rseq, &arenas->cls[cls],
+                      sizeof(percpu_arena_t), PERCPU_MAX_CPUS, ptr,
+                      PERCPU_SLOTS);
+}
+
+static void *percpu_pop(tbthread_t self, percpu_arena_t *arenas, int cls)
+{
+  return tb_rseq_pop(self->rseq, &arenas->cls[cls],
+                     sizeof(percpu_arena_t), PERCPU_MAX_CPUS);
+}
+
+//------------------------------------------------------------------------------
+// Take a block from the stack of the current CPU, refill it from the heap if
+// it's empty
+//------------------------------------------------------------------------------
+static void *percpu_alloc(tbthread_t self, percpu_arena_t *arenas, int cls)
+{
+  void *ptr = percpu_pop(self, arenas, cls);
+  if(ptr)
+    return ptr;
+
+  memory_lock_acquire();
+  ptr = heap_alloc((cls+1)*CACHE_CLASS_SIZE);
+  for(int i = 1; ptr && i < CACHE_BATCH; ++i) {
+    void *extra = heap_alloc((cls+1)*CACHE_CLASS_SIZE);
+    if(!extra)
+      break;
+    if(percpu_push(self, arenas, cls, extra)) {
+      heap_free(extra);
+      break;
+    }
   }
+  tb_futex_unlock(&memory_lock);
+  return ptr;
+}
 
-  //----------------------------------------------------------------------------
-  // Split the chunk if it's big enough to contain one more header and at least
-  // 16 more bytes
-  //----------------------------------------------------------------------------
-  if(chunk->size > alloc_size + sizeof(memchunk_t) + 16)
-  {
-    memchunk_t *new_chunk = (memchunk_t *)((char *)chunk+sizeof(memchunk_t)+alloc_size);
-    new_chunk->size = chunk->size-alloc_size-sizeof(memchunk_t);
-    new_chunk->next = chunk->next;
-    chunk->next = new_chunk;
-    chunk->size = alloc_size;
+//------------------------------------------------------------------------------
+// Put a block on the stack of the current CPU, give half of the stack back to
+// the heap if it's full
+//------------------------------------------------------------------------------
+static void percpu_free(tbthread_t self, percpu_arena_t *arenas, void *ptr,
+  uint64_t size)
+{
+  int cls = size/CACHE_CLASS_SIZE - 1;
+  if(!percpu_push(self, arenas, cls, ptr))
+    return;
+
+  memory_lock_acquire();
+  for(int i = 0; i < PERCPU_SLOTS/2; ++i) {
+    void *old = percpu_pop(self, arenas, cls);
+    if(!old)
+      break;
+    heap_free(old);
   }
+  if(percpu_push(self, arenas, cls, ptr))
+    heap_free(ptr);
+  tb_futex_unlock(&memory_lock);
+}
 
+//------------------------------------------------------------------------------
+// Give the blocks in the stacks of all the CPUs back to the heap. The stacks
+// can only be touched by the restartable sequences running on their CPU, so we
+// move to every CPU that has something in its stacks and empty them from
+// there. A free that has picked up the arenas before they were switched off
+// may still land in a stack afterwards, it's given back by the next flush.
+//------------------------------------------------------------------------------
+static void percpu_flush(tbthread_t self, percpu_arena_t *arenas)
+{
+  tbthread_cpuset_t old_set, set;
+  TBTHREAD_CPU_ZERO(&old_set);
+  if(SYSCALL3(__NR_sched_getaffinity, 0, sizeof(tbthread_cpuset_t),
+              &old_set) < 0)
+    return;
+
+  for(int cpu = 0; cpu < PERCPU_MAX_CPUS; ++cpu) {
+    int cls;
+    for(cls = 0; cls < TBTHREAD_MALLOC_CLASSES; ++cls)
+      if(arenas[cpu].cls[cls].count)
+        break;
+    if(cls == TBTHREAD_MALLOC_CLASSES)
+      continue;
+
+    TBTHREAD_CPU_ZERO(&set);
+    TBTHREAD_CPU_SET(cpu, &set);
+    if(tb_set_affinity(self, &set))
+      continue;
+
+    memory_lock_acquire();
+    for(cls = 0; cls < TBTHREAD_MALLOC_CLASSES; ++cls) {
+      void *ptr;
+      while((ptr = percpu_pop(self, arenas, cls)))
+        heap_free(ptr);
+    }
+    tb_futex_unlock(&memory_lock);
+  }
+  tb_set_affinity(self, &old_set);
+}
+
+//------------------------------------------------------------------------------
+// Malloc
+//------------------------------------------------------------------------------
+void *malloc(size_t size)
+{
   //----------------------------------------------------------------------------
-  // Mark the chunk as used and return the memory
+  // Try the thread cache first
   //----------------------------------------------------------------------------
-  chunk->size |= MEMCHUNK_USED;
+  if(tb_threads_initialized && size <= CACHE_MAX_SIZE) {
+    tbthread_t self = tbthread_self();
+    int cls = size ? (size-1)/CACHE_CLASS_SIZE : 0;
+    percpu_arena_t *arenas = percpu_arenas;
+    if(arenas && self->rseq)
+      return percpu_alloc(self, arenas, cls);
+    if(!self->malloc_cache[cls].head)
+      cache_take_remote(self);
+    if(!self->malloc_cache[cls].head)
+      cache_refill(self, cls);
+    void *ptr = self->malloc_cache[cls].head;
+    if(ptr) {
+      self->malloc_cache[cls].head = *(void **)ptr;
+      --self->malloc_cache[cls].count;
+    }
+    return ptr;
+  }
+
+  if(size >= mmap_threshold)
+    return mmap_alloc(size, 0);
+
+  memory_lock_acquire();
+  void *ptr = heap_alloc(size);
   tb_futex_unlock(&memory_lock);
-  return (char*)chunk+sizeof(memchunk_t);
+  return ptr;
 }
 
 //------------------------------------------------------------------------------
@@ -319,23 +1085,61 @@ void free(void *ptr)
   if(!ptr)
     return;
 
-  tb_futex_lock(&memory_lock);
   memchunk_t *chunk = (memchunk_t *)((char *)ptr-sizeof(memchunk_t));
-  chunk->size &= ~MEMCHUNK_USED;
+  if(chunk->size & MEMCHUNK_MMAPPED) {
+    mmap_free(chunk);
+    return;
+  }
+
+  //----------------------------------------------------------------------------
+  // Small blocks go back to the thread that owns them if it's still around,
+  // to the thread cache otherwise
+  //----------------------------------------------------------------------------
+  uint64_t size = CHUNK_SIZE(chunk);
+  if(tb_threads_initialized && size <= CACHE_MAX_SIZE) {
+    tbthread_t      self = tbthread_self();
+    uint16_t        owner = CHUNK_OWNER(chunk);
+    percpu_arena_t *arenas = percpu_arenas;
+    chunk->size &= ~MEMCHUNK_ZERO;
+    if(arenas && self->rseq)
+      percpu_free(self, arenas, ptr, size);
+    else if(!owner || owner == self->malloc_owner ||
+            !owner_push_remote(owner, ptr))
+      cache_put(self, ptr, size);
+    return;
+  }
+
+  memory_lock_acquire();
+  heap_free(ptr);
   tb_futex_unlock(&memory_lock);
 }
 
 //------------------------------------------------------------------------------
 // Calloc
 //------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+// Clear a freshly allocated block, memory that is known to be zero only needs
+// the bin links cleared
+//------------------------------------------------------------------------------
+static void chunk_clear(void *ptr, size_t size)
+{
+  memchunk_t *chunk = (memchunk_t *)((char *)ptr-sizeof(memchunk_t));
+  if(chunk->size & MEMCHUNK_ZERO)
+    memset(ptr, 0, size < sizeof(memlinks_t) ? size : sizeof(memlinks_t));
+  else
+    memset(ptr, 0, size);
+}
+
 void *calloc(size_t nmemb, size_t size)
 {
-  size_t alloc_size = nmemb*size;
+  size_t alloc_size;
+  if(__builtin_mul_overflow(nmemb, size, &alloc_size))
+    return 0;
+
   void *ptr = malloc(alloc_size);
-  char *cptr = ptr;
   if(!ptr)
     return ptr;
-  for(int i = 0; i < alloc_size; ++i, *cptr++ = 0);
+  chunk_clear(ptr, alloc_size);
   return ptr;
 }
 
@@ -344,43 +1148,205 @@ void *calloc(size_t nmemb, size_t size)
 //------------------------------------------------------------------------------
 void *realloc(void *ptr, size_t size)
 {
+  if(!ptr)
+    return malloc(size);
+
+  //----------------------------------------------------------------------------
+  // Let the kernel move the pages of large blocks around instead of copying
+  //----------------------------------------------------------------------------
   memchunk_t *chunk = (memchunk_t *)((char *)ptr-sizeof(memchunk_t));
-  void       *new_ptr = malloc(size);
-  char       *s = ptr;
-  char       *d = new_ptr;
-  size_t      min = chunk->size > size ? size : chunk->size;
+  if((chunk->size & MEMCHUNK_MMAPPED) && !chunk->prev_size &&
+     size >= mmap_threshold) {
+    size_t length = mmap_length(size);
+    if(!length)
+      return 0;
+    size_t old_length = CHUNK_SIZE(chunk)+sizeof(memchunk_t);
+    memchunk_t *new_chunk = tbmremap(chunk, old_length, length, MREMAP_MAYMOVE);
+    if((long)new_chunk < 0)
+      return 0;
+    new_chunk->size = (length-sizeof(memchunk_t)) | MEMCHUNK_USED |
+                      MEMCHUNK_MMAPPED;
+    return (char*)new_chunk+sizeof(memchunk_t);
+  }
+
+  //----------------------------------------------------------------------------
+  // Try to resize the block where it is, unless it's big enough to be moved to
+  // its own mapping
+  //----------------------------------------------------------------------------
+  if(!(chunk->size & MEMCHUNK_MMAPPED) && size < mmap_threshold) {
+    memory_lock_acquire();
+    int resized = heap_resize(chunk, size);
+    tb_futex_unlock(&memory_lock);
+    if(resized)
+      return ptr;
+  }
+
+  //----------------------------------------------------------------------------
+  // Move it otherwise
+  //----------------------------------------------------------------------------
+  void   *new_ptr = malloc(size);
+  size_t  old_size = CHUNK_SIZE(chunk);
+  if(!new_ptr)
+    return 0;
 
-  for(int i = 0; i < min; ++i, *d++ = *s++);
+  memcpy(new_ptr, ptr, old_size > size ? size : old_size);
   free(ptr);
   return new_ptr;
 }
 
 //------------------------------------------------------------------------------
-// Heap state for diagnostics
+// Aligned allocations, the alignment needs to be a power of two
 //------------------------------------------------------------------------------
-void tb_heap_state(uint64_t *total, uint64_t *allocated)
+void *tb_aligned_alloc(size_t alignment, size_t size)
 {
-  memchunk_t *cursor = &head;
-  memchunk_t *chunk  = 0;
+  if(!alignment || (alignment & (alignment-1)))
+    return 0;
 
-  *total    = 0;
-  *allocated = 0;
+  if(alignment <= 8)
+    return malloc(size);
+
+  if(size > SIZE_MAX - alignment - 2*sizeof(memchunk_t) - 16)
+    return 0;
+
+  if(size >= mmap_threshold)
+    return mmap_alloc(size, alignment);
+
+  memory_lock_acquire();
+  void *ptr = heap_alloc_aligned(size, alignment);
+  tb_futex_unlock(&memory_lock);
+  return ptr;
+}
 
-  while(cursor->next) {
-    chunk = cursor->next;
-    if(chunk->size & MEMCHUNK_USED)
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  if(alignment < sizeof(void *) || (alignment & (alignment-1)))
+    return EINVAL;
+  void *ptr = tb_aligned_alloc(alignment, size);
+  if(!ptr)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+  return tb_aligned_alloc(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+  return tb_aligned_alloc(alignment, size);
+}
+
+//------------------------------------------------------------------------------
+// Allocate a zeroed, cache line aligned array whose elements are padded to
+// TB_CACHELINE_ROUND(size) bytes, so that no two of them share a cache line
+//------------------------------------------------------------------------------
+void *tb_calloc_cacheline(size_t nmemb, size_t size)
+{
+  size_t alloc_size;
+  if(__builtin_mul_overflow(nmemb, TB_CACHELINE_ROUND(size), &alloc_size))
+    return 0;
+
+  void *ptr = tb_aligned_alloc(TB_CACHELINE_SIZE, alloc_size);
+  if(!ptr)
+    return ptr;
+  chunk_clear(ptr, alloc_size);
+  return ptr;
+}
+
+//------------------------------------------------------------------------------
+// Tune the allocator
+//------------------------------------------------------------------------------
+int tb_mallopt(int param, size_t value)
+{
+  if(param == TB_M_MMAP_THRESHOLD) {
+    mmap_threshold = value;
+    return 0;
+  }
+  if(param == TB_M_TRIM_THRESHOLD) {
+    trim_threshold = value;
+    return 0;
+  }
+
+  //----------------------------------------------------------------------------
+  // Switch the per-CPU arenas on or off. The blocks sitting in the stacks when
+  // they are switched off go back to the heap.
+  //----------------------------------------------------------------------------
+  if(param == TB_M_PERCPU) {
+    if(!value) {
+      percpu_arenas = 0;
+      tbthread_t self = tbthread_self();
+      if(percpu_mem && self->rseq)
+        percpu_flush(self, percpu_mem);
+      return 0;
+    }
+    if(!tb_rseq)
+      return -ENOSYS;
+    memory_lock_acquire();
+    if(!percpu_mem) {
+      void *mem = tbmmap(NULL, PERCPU_MAX_CPUS*sizeof(percpu_arena_t),
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if((long)mem >= 0)
+        percpu_mem = mem;
+    }
+    percpu_arenas = percpu_mem;
+    tb_futex_unlock(&memory_lock);
+    return percpu_arenas ? 0 : -ENOMEM;
+  }
+  return -EINVAL;
+}
+
+//------------------------------------------------------------------------------
+// Release the free memory of the heap, including the blocks cached by the
+// calling thread, keeping pad bytes at the top
+//------------------------------------------------------------------------------
+int tb_malloc_trim(size_t pad)
+{
+  tb_malloc_cache_drain();
+  memory_lock_acquire();
+  int ret = heap_trim(pad, 1);
+  tb_futex_unlock(&memory_lock);
+  return ret;
+}
+
+//------------------------------------------------------------------------------
+// Heap state for diagnostics. The fragmentation is reported as the free bytes
+// and the size of the largest free chunk, the closer the two are, the better.
+//------------------------------------------------------------------------------
+void tb_heap_state(uint64_t *total, uint64_t *allocated, uint64_t *free_bytes,
+  uint64_t *largest_free)
+{
+  *total        = 0;
+  *allocated    = 0;
+  *free_bytes   = 0;
+  *largest_free = 0;
+
+  memory_lock_acquire();
+  memchunk_t *chunk = tail ? heap_start : 0;
+  while(chunk) {
+    if(CHUNK_USED(chunk))
       ++(*allocated);
+    else {
+      *free_bytes += chunk->size;
+      if(chunk->size > *largest_free)
+        *largest_free = chunk->size;
+    }
     ++(*total);
-    cursor = cursor->next;
+    chunk = chunk == tail ? 0 : CHUNK_NEXT(chunk);
   }
+  tb_futex_unlock(&memory_lock);
 }
 
 //------------------------------------------------------------------------------
 // Add an element
 //------------------------------------------------------------------------------
+tb_objcache_t tb_list_cache = TB_OBJCACHE_INITIALIZER(sizeof(list_t), 0);
+
 int list_add_elem(list_t *list, void *element, int front)
 {
-  list_t *node = malloc(sizeof(list_t));
+  list_t *node = tb_objcache_alloc(&tb_list_cache);
   if(!node)
     return -ENOMEM;
   node->element = element;
@@ -468,7 +1434,7 @@ void list_clear(list_t *list)
   while(list->next) {
     list_t *node = list->next;
     list->next = list->next->next;
-    free(node);
+    tb_objcache_free(&tb_list_cache, node);
   }
 }
 
@@ -31,12 +31,18 @@
 // Constants
 //------------------------------------------------------------------------------
 #define TBTHREAD_MAX_KEYS 1024
+#define TBTHREAD_TLS_BLOCK 32
+#define TBTHREAD_TLS_BLOCKS (TBTHREAD_MAX_KEYS/TBTHREAD_TLS_BLOCK)
+#define TBTHREAD_MALLOC_CLASSES 16
+#define TBTHREAD_CPU_SETSIZE 1024
 #define TBTHREAD_MUTEX_NORMAL 0
 #define TBTHREAD_MUTEX_ERRORCHECK 1
 #define TBTHREAD_MUTEX_RECURSIVE 2
 #define TBTHREAD_MUTEX_DEFAULT 0
 #define TBTHREAD_CREATE_DETACHED 0
 #define TBTHREAD_CREATE_JOINABLE 1
+#define TBTHREAD_DESC_SEPARATE 0
+#define TBTHREAD_DESC_IN_STACK 1
 #define TBTHREAD_CANCEL_ENABLE 1
 #define TBTHREAD_CANCEL_DISABLE 0
 #define TBTHREAD_CANCEL_DEFERRED 1
@@ -51,6 +57,12 @@
 #define TBTHREAD_PRIO_INHERIT 4
 #define TBTHREAD_PRIO_PROTECT 5
 
+#define TBTHREAD_PROCESS_PRIVATE 0
+#define TBTHREAD_PROCESS_SHARED 1
+
+#define TBTHREAD_MUTEX_SPIN_NONE 0
+#define TBTHREAD_MUTEX_SPIN_ADAPTIVE 1
+
 //------------------------------------------------------------------------------
 // List struct
 //------------------------------------------------------------------------------
@@ -60,6 +72,50 @@ typedef struct list {
   void        *element;
 } list_t;
 
+//------------------------------------------------------------------------------
+// Object cache
+//------------------------------------------------------------------------------
+typedef struct
+{
+  int        lock;
+  uint16_t   lock_spins;
+  uint32_t   size;
+  void     (*ctor)(void *);
+  void      *free_objs;
+  void      *slabs;
+} tb_objcache_t;
+
+#define TB_OBJCACHE_INITIALIZER(size, ctor) \
+  {0, 0, ((size) < 8 ? 8 : ((size) + 7) & ~7), (ctor), 0, 0}
+
+//------------------------------------------------------------------------------
+// CPU set
+//------------------------------------------------------------------------------
+typedef struct
+{
+  uint64_t bits[TBTHREAD_CPU_SETSIZE/64];
+} tbthread_cpuset_t;
+
+#define TBTHREAD_CPU_ZERO(set) (*(set) = (tbthread_cpuset_t){{0}})
+#define TBTHREAD_CPU_SET(cpu, set) \
+  ((set)->bits[(cpu)/64] |= (1ULL << ((cpu)%64)))
+#define TBTHREAD_CPU_CLR(cpu, set) \
+  ((set)->bits[(cpu)/64] &= ~(1ULL << ((cpu)%64)))
+#define TBTHREAD_CPU_ISSET(cpu, set) \
+  (((set)->bits[(cpu)/64] >> ((cpu)%64)) & 1)
+
+//------------------------------------------------------------------------------
+// Thread group
+//------------------------------------------------------------------------------
+typedef struct
+{
+  uint32_t seq;
+  uint32_t running;
+  list_t   done;
+} tbthread_group_t;
+
+#define TBTHREAD_GROUP_INITIALIZER {0, 0, {0, 0, 0}}
+
 //------------------------------------------------------------------------------
 // Thread attirbutes
 //------------------------------------------------------------------------------
@@ -70,10 +126,24 @@ typedef struct
   uint8_t   sched_inherit;
   uint8_t   sched_policy;
   uint8_t   sched_priority;
+  uint8_t   desc_placement;
+  uint8_t   affinity_set;
+  tbthread_cpuset_t affinity;
+  tbthread_group_t *group;
 } tbthread_attr_t;
 
 //------------------------------------------------------------------------------
-// Thread descriptor
+// Thread specific data slot
+//------------------------------------------------------------------------------
+typedef struct
+{
+  uint64_t seq;
+  void *data;
+} tb_tls_slot_t;
+
+//------------------------------------------------------------------------------
+// Thread descriptor. The first TBTHREAD_TLS_BLOCK TLS slots live inline, the
+// blocks for the remaining keys are allocated when first set.
 //------------------------------------------------------------------------------
 typedef struct tbthread
 {
@@ -81,24 +151,38 @@ typedef struct tbthread
   void *stack;
   uint32_t stack_size;
   uint32_t tid;
+  uint32_t dl_reserved[2]; // glibc's dynamic linker writes its global scope
+                           // flag at %fs:0x1c when resolving symbols lazily
   void *(*fn)(void *);
   void *arg;
   void *retval;
-  struct
-  {
-    uint64_t seq;
-    void *data;
-  } tls[TBTHREAD_MAX_KEYS];
+  tb_tls_slot_t tls[TBTHREAD_TLS_BLOCK];
+  tb_tls_slot_t *tls_blocks[TBTHREAD_TLS_BLOCKS-1];
   uint8_t join_status;
   uint8_t cancel_status;
+  uint8_t desc_placement;
+  uint8_t reservoir;
   uint16_t sched_info;
   uint16_t user_sched_info;
   struct tbthread *joiner;
   list_t cleanup_handlers;
   list_t protect_mutexes;
   list_t inherit_mutexes;
-  uint32_t start_status;
+  const tbthread_attr_t *start_attr;
+  int32_t *start_result;
+  uint32_t run_status;
+  list_t reservoir_node;
+  tbthread_group_t *group;
+  list_t group_node;
   uint32_t lock;
+  struct
+  {
+    void *head;
+    uint32_t count;
+  } malloc_cache[TBTHREAD_MALLOC_CLASSES];
+  uint16_t malloc_owner;
+  struct rseq *rseq;
+  uint8_t rseq_area[64];
 } *tbthread_t;
 
 //------------------------------------------------------------------------------
@@ -109,6 +193,8 @@ typedef struct
   uint8_t type;
   uint8_t protocol;
   uint8_t prioceiling;
+  uint8_t spin;
+  uint8_t pshared;
 } tbthread_mutexattr_t;
 
 //------------------------------------------------------------------------------
@@ -123,9 +209,13 @@ typedef struct
   tbthread_t owner;
   uint64_t   counter;
   uint32_t   internal_futex;
+  uint8_t    spin;
+  uint16_t   spin_count;
+  uint8_t    pshared;
 } tbthread_mutex_t;
 
-#define TBTHREAD_MUTEX_INITIALIZER {0, 0, TBTHREAD_PRIO_NONE, 0, 0, 0, 0}
+#define TBTHREAD_MUTEX_INITIALIZER {0, 0, TBTHREAD_PRIO_NONE, 0, 0, 0, 0, \
+  TBTHREAD_MUTEX_SPIN_NONE, 0, TBTHREAD_PROCESS_PRIVATE}
 
 //------------------------------------------------------------------------------
 // Once
@@ -137,6 +227,10 @@ typedef int tbthread_once_t;
 //------------------------------------------------------------------------------
 // RW lock
 //------------------------------------------------------------------------------
+typedef struct {
+  uint8_t pshared;
+} tbthread_rwlockattr_t;
+
 typedef struct {
   int lock;
   int writers_queued;
@@ -144,13 +238,18 @@ typedef struct {
   int wr_futex;
   tbthread_t writer;
   int readers;
+  uint8_t pshared;
 } tbthread_rwlock_t;
 
-#define TBTHREAD_RWLOCK_INIT {0, 0, 0, 0, 0, 0}
+#define TBTHREAD_RWLOCK_INIT {0, 0, 0, 0, 0, 0, TBTHREAD_PROCESS_PRIVATE}
 
 //------------------------------------------------------------------------------
 // Condvar
 //------------------------------------------------------------------------------
+typedef struct {
+  uint8_t pshared;
+} tbthread_condattr_t;
+
 typedef struct {
   int lock;
   int futex;
@@ -158,9 +257,10 @@ typedef struct {
   uint64_t signal_num;
   uint64_t broadcast_seq;
   tbthread_mutex_t *mutex;
+  uint8_t pshared;
 } tbthread_cond_t;
 
-#define TBTHREAD_COND_INITIALIZER {0, 0, 0, 0, 0, 0}
+#define TBTHREAD_COND_INITIALIZER {0, 0, 0, 0, 0, 0, TBTHREAD_PROCESS_PRIVATE}
 
 //------------------------------------------------------------------------------
 // General threading
@@ -169,12 +269,22 @@ void tbthread_init();
 void tbthread_finit();
 void tbthread_attr_init(tbthread_attr_t *attr);
 int tbthread_attr_setdetachstate(tbthread_attr_t *attr, int state);
+int tbthread_attr_setdescplacement(tbthread_attr_t *attr, int placement);
+int tbthread_attr_setgroup(tbthread_attr_t *attr, tbthread_group_t *group);
+int tbthread_reservoir_init(int n, const tbthread_attr_t *attr);
 int tbthread_create(tbthread_t *thread, const tbthread_attr_t *attrs,
   void *(*f)(void *), void *arg);
-void tbthread_exit(void *retval);
+void tbthread_exit(void *retval) __attribute__((noreturn));
 int tbthread_detach(tbthread_t thread);
 int tbthread_join(tbthread_t thread, void **retval);
+int tbthread_tryjoin(tbthread_t thread, void **retval);
+int tbthread_timedjoin(tbthread_t thread, void **retval,
+                       const struct timespec *abstime);
 int tbthread_equal(tbthread_t t1, tbthread_t t2);
+void tbthread_group_init(tbthread_group_t *group);
+int tbthread_group_wait_all(tbthread_group_t *group);
+int tbthread_group_wait_any(tbthread_group_t *group, tbthread_t *thread,
+                            void **retval);
 int tbthread_once(tbthread_once_t *once, void (*func)(void));
 int tbthread_cancel(tbthread_t thread);
 void tbthread_cleanup_push(void (*func)(void *), void *arg);
@@ -187,7 +297,17 @@ void tbthread_testcancel();
 // TLS
 //------------------------------------------------------------------------------
 typedef uint16_t tbthread_key_t;
-tbthread_t tbthread_self();
+
+//------------------------------------------------------------------------------
+// Get the pointer of the currently running thread
+//------------------------------------------------------------------------------
+static inline tbthread_t tbthread_self()
+{
+  tbthread_t self;
+  asm volatile("movq %%fs:0, %0\n\t" : "=r" (self));
+  return self;
+}
+
 int tbthread_key_create(tbthread_key_t *key, void (*destructor)(void *));
 int tbthread_key_delete(tbthread_key_t key);
 void *tbthread_getspecific(tbthread_key_t key);
@@ -200,13 +320,61 @@ int tbthread_mutexattr_init(tbthread_mutexattr_t *attr);
 int tbthread_mutexattr_destroy(tbthread_mutexattr_t *attr);
 int tbthread_mutexattr_gettype(const tbthread_mutexattr_t *attr, int *type);
 int tbthread_mutexattr_settype(tbthread_mutexattr_t *attr, int type);
+int tbthread_mutexattr_getspin(const tbthread_mutexattr_t *attr, int *spin);
+int tbthread_mutexattr_setspin(tbthread_mutexattr_t *attr, int spin);
+int tbthread_mutexattr_getpshared(const tbthread_mutexattr_t *attr,
+  int *pshared);
+int tbthread_mutexattr_setpshared(tbthread_mutexattr_t *attr, int pshared);
 
 int tbthread_mutex_init(tbthread_mutex_t *mutex,
   const tbthread_mutexattr_t *attr);
 int tbthread_mutex_destroy(tbthread_mutex_t *mutex);
-int tbthread_mutex_lock(tbthread_mutex_t *mutex);
-int tbthread_mutex_trylock(tbthread_mutex_t *mutex);
-int tbthread_mutex_unlock(tbthread_mutex_t *mutex);
+int tbthread_mutex_lock_slow(tbthread_mutex_t *mutex);
+int tbthread_mutex_trylock_slow(tbthread_mutex_t *mutex);
+int tbthread_mutex_unlock_slow(tbthread_mutex_t *mutex);
+
+//------------------------------------------------------------------------------
+// Uncontended normal mutexes without a priority protocol are handled inline,
+// everything else goes to the slow path in the library
+//------------------------------------------------------------------------------
+#define TBTHREAD_MUTEX_FAST(mutex) \
+  ((mutex)->type == TBTHREAD_MUTEX_NORMAL && \
+   (mutex)->protocol == TBTHREAD_PRIO_NONE)
+
+static inline int tbthread_mutex_lock(tbthread_mutex_t *mutex)
+{
+  if(TBTHREAD_MUTEX_FAST(mutex) &&
+     __sync_bool_compare_and_swap(&mutex->futex, 0, 1)) {
+    mutex->owner = tbthread_self();
+    return 0;
+  }
+  return tbthread_mutex_lock_slow(mutex);
+}
+
+static inline int tbthread_mutex_trylock(tbthread_mutex_t *mutex)
+{
+  if(TBTHREAD_MUTEX_FAST(mutex)) {
+    if(!__sync_bool_compare_and_swap(&mutex->futex, 0, 1))
+      return -EBUSY;
+    mutex->owner = tbthread_self();
+    return 0;
+  }
+  return tbthread_mutex_trylock_slow(mutex);
+}
+
+//------------------------------------------------------------------------------
+// If the futex is not 1, somebody is waiting and we need to wake them up in the
+// slow path
+//------------------------------------------------------------------------------
+static inline int tbthread_mutex_unlock(tbthread_mutex_t *mutex)
+{
+  if(TBTHREAD_MUTEX_FAST(mutex)) {
+    mutex->owner = 0;
+    if(__sync_bool_compare_and_swap(&mutex->futex, 1, 0))
+      return 0;
+  }
+  return tbthread_mutex_unlock_slow(mutex);
+}
 
 //------------------------------------------------------------------------------
 // Scheduling
@@ -218,6 +386,11 @@ int tbthread_attr_setschedpolicy(tbthread_attr_t *attr, int policy);
 int tbthread_attr_setschedpriority(tbthread_attr_t *attr, int priority);
 int tbthread_attr_setinheritsched(tbthread_attr_t *attr, int inheritsched);
 
+int tbthread_setaffinity(tbthread_t thread, const tbthread_cpuset_t *set);
+int tbthread_getaffinity(tbthread_t thread, tbthread_cpuset_t *set);
+int tbthread_attr_setaffinity(tbthread_attr_t *attr,
+  const tbthread_cpuset_t *set);
+
 int tbthread_mutexattr_setprioceiling(tbthread_mutexattr_t *attr, int ceiling);
 int tbthread_mutexattr_setprotocol(tbthread_mutexattr_t *attr, int protocol);
 
@@ -228,7 +401,14 @@ int tbthread_mutex_setprioceiling(tbthread_mutex_t *mutex, int ceiling,
 //------------------------------------------------------------------------------
 // RW Lock
 //-----------------------------------------------------------------------------
-int tbthread_rwlock_init(tbthread_rwlock_t *rwlock);
+int tbthread_rwlockattr_init(tbthread_rwlockattr_t *attr);
+int tbthread_rwlockattr_destroy(tbthread_rwlockattr_t *attr);
+int tbthread_rwlockattr_getpshared(const tbthread_rwlockattr_t *attr,
+  int *pshared);
+int tbthread_rwlockattr_setpshared(tbthread_rwlockattr_t *attr, int pshared);
+
+int tbthread_rwlock_init(tbthread_rwlock_t *rwlock,
+  const tbthread_rwlockattr_t *attr);
 int tbthread_rwlock_destroy(tbthread_rwlock_t *rwlock);
 
 int tbthread_rwlock_rdlock(tbthread_rwlock_t *rwlock);
@@ -241,6 +421,14 @@ int tbthread_rwlock_trywrlock(tbthread_rwlock_t *rwlock);
 //------------------------------------------------------------------------------
 // Condvar
 //------------------------------------------------------------------------------
+int tbthread_condattr_init(tbthread_condattr_t *attr);
+int tbthread_condattr_destroy(tbthread_condattr_t *attr);
+int tbthread_condattr_getpshared(const tbthread_condattr_t *attr,
+  int *pshared);
+int tbthread_condattr_setpshared(tbthread_condattr_t *attr, int pshared);
+
+int tbthread_cond_init(tbthread_cond_t *cond, const tbthread_condattr_t *attr);
+int tbthread_cond_destroy(tbthread_cond_t *cond);
 int tbthread_cond_broadcast(tbthread_cond_t *cond);
 int tbthread_cond_signal(tbthread_cond_t *cond);
 int tbthread_cond_wait(tbthread_cond_t *cond, tbthread_mutex_t *mutex);
@@ -248,16 +436,34 @@ int tbthread_cond_wait(tbthread_cond_t *cond, tbthread_mutex_t *mutex);
 //------------------------------------------------------------------------------
 // Utility functions
 //------------------------------------------------------------------------------
+#define TB_M_MMAP_THRESHOLD 1
+#define TB_M_TRIM_THRESHOLD 2
+#define TB_M_PERCPU         3
+
+#define TB_CACHELINE_SIZE 64
+#define TB_CACHELINE_ROUND(size) \
+  (((size) + TB_CACHELINE_SIZE - 1) & ~(size_t)(TB_CACHELINE_SIZE - 1))
+
 void *malloc(size_t size);
 void free(void *ptr);
 void *realloc(void *ptr, size_t size);
 void *calloc(size_t nmemb, size_t size);
+void *tb_aligned_alloc(size_t alignment, size_t size);
+int posix_memalign(void **memptr, size_t alignment, size_t size);
+void *memalign(size_t alignment, size_t size);
+void *aligned_alloc(size_t alignment, size_t size);
+void *tb_calloc_cacheline(size_t nmemb, size_t size);
+int tb_mallopt(int param, size_t value);
+int tb_malloc_trim(size_t pad);
 void tbprint(const char *format, ...);
 int tbwrite(int fd, const char *buffer, unsigned long len);
 void tbsleep(int secs);
 void *tbmmap(void *addr, unsigned long length, int prot, int flags, int fd,
   unsigned long offset);
 int tbmunmap(void *addr, unsigned long length);
+void *tbmremap(void *addr, unsigned long old_length, unsigned long new_length,
+  int flags);
+int tbmadvise(void *addr, unsigned long length, int advice);
 
 int tbclone(int (*fn)(void *), void *arg, int flags, void *child_stack, ...
   /* pid_t *ptid, pid_t *ctid, void *tls */ );
@@ -311,6 +517,14 @@ int tbsigaction(int signum, struct sigaction *act, struct sigaction *old);
 #define SYSCALL6(name, a1, a2, a3, a4, a5, a6) \
   SYSCALL(name, a1, a2, a3, a4, a5, a6)
 
+//------------------------------------------------------------------------------
+// Object caches
+//------------------------------------------------------------------------------
+tb_objcache_t *tb_objcache_create(size_t size, void (*ctor)(void *));
+void tb_objcache_destroy(tb_objcache_t *cache);
+void *tb_objcache_alloc(tb_objcache_t *cache);
+void tb_objcache_free(tb_objcache_t *cache, void *obj);
+
 //------------------------------------------------------------------------------
 // List ops
 //------------------------------------------------------------------------------
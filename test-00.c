@@ -23,7 +23,8 @@
 //------------------------------------------------------------------------------
 // Prototype for a hidden function
 //------------------------------------------------------------------------------
-void tb_heap_state(uint64_t *total, uint64_t *allocated);
+void tb_heap_state(uint64_t *total, uint64_t *allocated, uint64_t *free_bytes,
+  uint64_t *largest_free);
 
 //------------------------------------------------------------------------------
 // Check if the state of the heap memory is consistent
@@ -94,9 +95,11 @@ int main(int argc, char **argv)
   //----------------------------------------------------------------------------
   // Check up the heap
   //----------------------------------------------------------------------------
-  uint64_t total, allocated;
-  tb_heap_state(&total, &allocated);
+  uint64_t total, allocated, free_bytes, largest_free;
+  tb_heap_state(&total, &allocated, &free_bytes, &largest_free);
   tbprint("Total chunks on the heap: %llu, allocated: %llu\n",
     total, allocated);
+  tbprint("Free bytes: %llu, largest free chunk: %llu\n",
+    free_bytes, largest_free);
   return 0;
 };
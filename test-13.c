@@ -0,0 +1,239 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+
+#include <tb.h>
+#include <string.h>
+
+#define THREADS 4
+
+tbthread_key_t key;
+tbthread_mutex_t mutex = TBTHREAD_MUTEX_INITIALIZER;
+int detached_done = 0;
+tbthread_t handles[THREADS];
+uint32_t tids[THREADS];
+int num_handles = 0;
+
+//------------------------------------------------------------------------------
+// Thread function, the key needs to be clear every time the thread gets work
+//------------------------------------------------------------------------------
+void *thread_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  tbprint("[thread 0x%llx] Running job #%d\n", self, (int)(long)arg);
+  if(tbthread_getspecific(key)) {
+    tbprint("[thread 0x%llx] Leftover thread-specific data\n", self);
+    return (void *)-1;
+  }
+  tbthread_setspecific(key, arg);
+  return arg;
+}
+
+//------------------------------------------------------------------------------
+// Thread function, exit from a nested call
+//------------------------------------------------------------------------------
+long nested_exit(int depth, void *arg)
+{
+  if(depth > 0)
+    return nested_exit(depth-1, arg) + depth;
+  if(arg)
+    tbthread_exit(arg);
+  return 0;
+}
+
+void *thread_func_exit(void *arg)
+{
+  return (void *)nested_exit(10, arg);
+}
+
+//------------------------------------------------------------------------------
+// Thread function, wait to be canceled
+//------------------------------------------------------------------------------
+void *thread_func_cancel(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  tbprint("[thread 0x%llx] Waiting to be canceled\n", self);
+  while(1) {
+    tbthread_testcancel();
+    tbsleep(0);
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Thread function, detached
+//------------------------------------------------------------------------------
+void *thread_func_detached(void *arg)
+{
+  tbthread_mutex_lock(&mutex);
+  ++detached_done;
+  tbthread_mutex_unlock(&mutex);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// All the jobs need to run on the parked threads, so we should never see more
+// than THREADS different handles and TIDs
+//------------------------------------------------------------------------------
+int check_parked(tbthread_t thread)
+{
+  for(int i = 0; i < num_handles; ++i)
+    if(handles[i] == thread && tids[i] == thread->tid)
+      return 0;
+
+  if(num_handles == THREADS) {
+    tbprint("[thread main] Thread 0x%llx (TID %d) is not from the reservoir\n",
+      thread, thread->tid);
+    return -EINVAL;
+  }
+  handles[num_handles] = thread;
+  tids[num_handles++] = thread->tid;
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Create a thread and join it, check the return value
+//------------------------------------------------------------------------------
+int run(tbthread_attr_t *attr, void *(*func)(void *), void *arg,
+  void *expected)
+{
+  tbthread_t thread;
+  void *ret;
+  int st = tbthread_create(&thread, attr, func, arg);
+  if(st != 0) {
+    tbprint("Failed to spawn a thread: %s\n", tbstrerror(-st));
+    return st;
+  }
+
+  if((st = check_parked(thread)))
+    return st;
+
+  if(func == thread_func_cancel) {
+    tbsleep(1);
+    tbthread_cancel(thread);
+  }
+
+  st = tbthread_join(thread, &ret);
+  if(st != 0) {
+    tbprint("Failed to join a thread: %s\n", tbstrerror(-st));
+    return st;
+  }
+
+  if(ret != expected) {
+    tbprint("[thread main] Unexpected return value: 0x%llx\n", ret);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_attr_t attr;
+  tbthread_attr_t dattr;
+  int             st = 0;
+  tbthread_attr_init(&attr);
+  tbthread_key_create(&key, 0);
+
+  //----------------------------------------------------------------------------
+  // Set up the reservoir
+  //----------------------------------------------------------------------------
+  tbprint("[thread main] Testing the reservoir setup\n");
+  if(tbthread_reservoir_init(0, &attr) != -EINVAL) {
+    tbprint("Empty reservoir shouldn't have been created\n");
+    st = -EINVAL;
+    goto exit;
+  }
+
+  st = tbthread_reservoir_init(THREADS, &attr);
+  if(st != 0) {
+    tbprint("Failed to set up the reservoir: %s\n", tbstrerror(-st));
+    goto exit;
+  }
+
+  if(tbthread_reservoir_init(THREADS, &attr) != -EBUSY) {
+    tbprint("Reservoir shouldn't have been set up twice\n");
+    st = -EINVAL;
+    goto exit;
+  }
+
+  //----------------------------------------------------------------------------
+  // Hand work over to the parked threads, more jobs than threads
+  //----------------------------------------------------------------------------
+  tbprint("---\n");
+  tbprint("[thread main] Testing handing work over to the parked threads\n");
+  for(long i = 1; i <= 3*THREADS; ++i)
+    if((st = run(&attr, thread_func, (void *)i, (void *)i)))
+      goto exit;
+
+  //----------------------------------------------------------------------------
+  // The threads need to come back after tbthread_exit and cancelation
+  //----------------------------------------------------------------------------
+  tbprint("---\n");
+  tbprint("[thread main] Testing tbthread_exit and cancelation\n");
+  for(long i = 1; i <= THREADS; ++i) {
+    if((st = run(&attr, thread_func_exit, (void *)i, (void *)i)))
+      goto exit;
+    if((st = run(&attr, thread_func_cancel, 0, TBTHREAD_CANCELED)))
+      goto exit;
+    if((st = run(&attr, thread_func, (void *)i, (void *)i)))
+      goto exit;
+  }
+
+  //----------------------------------------------------------------------------
+  // Detached threads go back on their own
+  //----------------------------------------------------------------------------
+  tbprint("---\n");
+  tbprint("[thread main] Testing detached threads\n");
+  dattr = attr;
+  tbthread_attr_setdetachstate(&dattr, TBTHREAD_CREATE_DETACHED);
+  for(int i = 0; i < 2*THREADS; ++i) {
+    tbthread_t thread;
+    st = tbthread_create(&thread, &dattr, thread_func_detached, 0);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      goto exit;
+    }
+    if((st = check_parked(thread)))
+      goto exit;
+    tbsleep(0);
+  }
+
+  for(int i = 0; i < 5 && detached_done != 2*THREADS; ++i)
+    tbsleep(1);
+
+  if(detached_done != 2*THREADS) {
+    tbprint("Only %d of %d detached threads finished\n", detached_done,
+      2*THREADS);
+    st = -EINVAL;
+    goto exit;
+  }
+
+  if((st = run(&attr, thread_func, (void *)1, (void *)1)))
+    goto exit;
+  tbprint("[thread main] All good\n");
+
+exit:
+  tbthread_finit();
+  return st;
+};
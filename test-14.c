@@ -0,0 +1,144 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+
+#include <tb.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+// Thread function
+//------------------------------------------------------------------------------
+void *thread_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  int secs = *(int*)arg;
+  tbprint("[thread 0x%llx] Sleeping %d seconds\n", self, secs);
+  tbsleep(secs);
+  return arg;
+}
+
+//------------------------------------------------------------------------------
+// Absolute time secs seconds from now
+//------------------------------------------------------------------------------
+void deadline(struct timespec *ts, int secs)
+{
+  SYSCALL2(__NR_clock_gettime, CLOCK_REALTIME, ts);
+  ts->tv_sec += secs;
+}
+
+//------------------------------------------------------------------------------
+// Check the result of a call
+//------------------------------------------------------------------------------
+int check(const char *what, int st, int expected)
+{
+  if(st == expected) {
+    tbprint("[thread main] %s: %s as expected\n", what,
+      st ? tbstrerror(-st) : "success");
+    return 0;
+  }
+  tbprint("[thread main] %s: unexpected result: %s\n", what,
+    st ? tbstrerror(-st) : "success");
+  return st ? st : -EINVAL;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_t       thread;
+  tbthread_attr_t  attr;
+  struct timespec  ts;
+  int              secs = 3;
+  void            *ret;
+  int              st = 0;
+  tbthread_attr_init(&attr);
+
+  //----------------------------------------------------------------------------
+  // Try to join a running thread, then wait for it to finish
+  //----------------------------------------------------------------------------
+  tbprint("[thread main] Testing tbthread_tryjoin\n");
+  st = tbthread_create(&thread, &attr, thread_func, &secs);
+  if(st != 0) {
+    tbprint("Failed to spawn a thread: %s\n", tbstrerror(-st));
+    goto exit;
+  }
+
+  if((st = check("Try join", tbthread_tryjoin(thread, &ret), -EBUSY)))
+    goto exit;
+
+  tbsleep(secs+1);
+  if((st = check("Try join", tbthread_tryjoin(thread, &ret), 0)))
+    goto exit;
+
+  if(ret != &secs) {
+    tbprint("[thread main] Wrong return value\n");
+    st = -EINVAL;
+    goto exit;
+  }
+
+  //----------------------------------------------------------------------------
+  // Time out, then join with a deadline that is far enough
+  //----------------------------------------------------------------------------
+  tbprint("---\n");
+  tbprint("[thread main] Testing tbthread_timedjoin\n");
+  st = tbthread_create(&thread, &attr, thread_func, &secs);
+  if(st != 0) {
+    tbprint("Failed to spawn a thread: %s\n", tbstrerror(-st));
+    goto exit;
+  }
+
+  deadline(&ts, 1);
+  if((st = check("Timed join", tbthread_timedjoin(thread, &ret, &ts),
+                 -ETIMEDOUT)))
+    goto exit;
+
+  deadline(&ts, secs+2);
+  if((st = check("Timed join", tbthread_timedjoin(thread, &ret, &ts), 0)))
+    goto exit;
+
+  //----------------------------------------------------------------------------
+  // The thread may be detached after a timeout
+  //----------------------------------------------------------------------------
+  tbprint("---\n");
+  tbprint("[thread main] Testing detaching after a timeout\n");
+  st = tbthread_create(&thread, &attr, thread_func, &secs);
+  if(st != 0) {
+    tbprint("Failed to spawn a thread: %s\n", tbstrerror(-st));
+    goto exit;
+  }
+
+  deadline(&ts, 1);
+  if((st = check("Timed join", tbthread_timedjoin(thread, &ret, &ts),
+                 -ETIMEDOUT)))
+    goto exit;
+
+  if((st = check("Detach", tbthread_detach(thread), 0)))
+    goto exit;
+
+  if((st = check("Try join", tbthread_tryjoin(thread, &ret), -EINVAL)))
+    goto exit;
+  tbsleep(secs);
+
+exit:
+  tbthread_finit();
+  return st;
+};
@@ -0,0 +1,178 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+
+#include <tb.h>
+#include <string.h>
+
+#define THREADS 8
+
+tbthread_mutex_t mutex = TBTHREAD_MUTEX_INITIALIZER;
+int detached_done = 0;
+
+//------------------------------------------------------------------------------
+// Thread function, the later threads finish first
+//------------------------------------------------------------------------------
+void *thread_func(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  int num = *(int*)arg;
+  tbprint("[thread 0x%llx] Hello from thread #%d\n", self, num);
+  tbsleep((THREADS-num)/2);
+  if(num % 2) {
+    tbthread_mutex_lock(&mutex);
+    ++detached_done;
+    tbthread_mutex_unlock(&mutex);
+  }
+  return arg;
+}
+
+//------------------------------------------------------------------------------
+// Spawn the threads in the group, the odd ones detached
+//------------------------------------------------------------------------------
+int spawn(tbthread_group_t *group, tbthread_t thread[THREADS],
+  int targ[THREADS])
+{
+  tbthread_attr_t attr;
+  tbthread_attr_t dattr;
+  tbthread_attr_init(&attr);
+  tbthread_attr_setgroup(&attr, group);
+  dattr = attr;
+  tbthread_attr_setdetachstate(&dattr, TBTHREAD_CREATE_DETACHED);
+
+  detached_done = 0;
+  for(int i = 0; i < THREADS; ++i) {
+    targ[i] = i;
+    int st = tbthread_create(&thread[i], i % 2 ? &dattr : &attr, thread_func,
+      &targ[i]);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      return st;
+    }
+  }
+  tbprint("[thread main] Threads spawned successfully\n");
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_group_t group;
+  tbthread_t       thread[THREADS];
+  int              targ[THREADS];
+  int              seen[THREADS];
+  int              st = 0;
+  tbthread_group_init(&group);
+
+  //----------------------------------------------------------------------------
+  // Join the joinable members as they finish, the detached ones are counted
+  // but not reported
+  //----------------------------------------------------------------------------
+  tbprint("[thread main] Testing wait any\n");
+  if((st = spawn(&group, thread, targ)))
+    goto exit;
+
+  memset(seen, 0, sizeof(seen));
+  int last = THREADS;
+  tbthread_t th;
+  void *ret;
+  while(!(st = tbthread_group_wait_any(&group, &th, &ret))) {
+    int num = *(int*)ret;
+    tbprint("[thread main] Thread #%d (0x%llx) joined\n", num, th);
+    if(num % 2 || seen[num] || th != thread[num] || num > last) {
+      tbprint("[thread main] Thread #%d shouldn't have been joined now\n",
+        num);
+      st = -EINVAL;
+      goto exit;
+    }
+    seen[num] = 1;
+    last = num;
+  }
+
+  if(st != -ECHILD) {
+    tbprint("Waiting for any thread failed: %s\n", tbstrerror(-st));
+    goto exit;
+  }
+
+  for(int i = 0; i < THREADS; i += 2)
+    if(!seen[i]) {
+      tbprint("[thread main] Thread #%d hasn't been joined\n", i);
+      st = -EINVAL;
+      goto exit;
+    }
+
+  if(detached_done != THREADS/2) {
+    tbprint("[thread main] Only %d detached threads finished\n",
+      detached_done);
+    st = -EINVAL;
+    goto exit;
+  }
+  tbprint("[thread main] All the threads joined\n");
+
+  //----------------------------------------------------------------------------
+  // Wait for all and make sure that nothing is left to join
+  //----------------------------------------------------------------------------
+  tbprint("---\n");
+  tbprint("[thread main] Testing wait all\n");
+  if((st = spawn(&group, thread, targ)))
+    goto exit;
+
+  st = tbthread_join(thread[0], &ret);
+  if(st != 0 || ret != &targ[0]) {
+    tbprint("Failed to join thread 0: %s\n", tbstrerror(-st));
+    goto exit;
+  }
+
+  st = tbthread_group_wait_all(&group);
+  if(st != 0) {
+    tbprint("Waiting for all threads failed: %s\n", tbstrerror(-st));
+    goto exit;
+  }
+
+  if(detached_done != THREADS/2) {
+    tbprint("[thread main] Only %d detached threads finished\n",
+      detached_done);
+    st = -EINVAL;
+    goto exit;
+  }
+
+  for(int i = 2; i < THREADS; i += 2)
+    if(tbthread_join(thread[i], 0) != -ESRCH) {
+      tbprint("[thread main] Thread #%d hasn't been joined\n", i);
+      st = -EINVAL;
+      goto exit;
+    }
+
+  st = tbthread_group_wait_any(&group, &th, &ret);
+  if(st != -ECHILD) {
+    tbprint("[thread main] The group should have been empty\n");
+    st = -EINVAL;
+    goto exit;
+  }
+  st = 0;
+  tbprint("[thread main] All the threads joined\n");
+
+exit:
+  tbthread_finit();
+  return st;
+};
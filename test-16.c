@@ -0,0 +1,159 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+
+#define THREADS 4
+#define BLOCKS  256
+
+//------------------------------------------------------------------------------
+// Prototype for a hidden function
+//------------------------------------------------------------------------------
+void tb_heap_state(uint64_t *total, uint64_t *allocated, uint64_t *free_bytes,
+  uint64_t *largest_free);
+
+//------------------------------------------------------------------------------
+// Allocate and free small blocks of all the sizes, check that nobody else
+// scribbles over them
+//------------------------------------------------------------------------------
+void *thread_func(void *arg)
+{
+  int            num = *(int*)arg;
+  uint32_t       seed = tbtime() + num;
+  unsigned char *addrs[BLOCKS];
+  uint32_t       sizes[BLOCKS];
+
+  for(int k = 0; k < 100; ++k) {
+    for(int i = 0; i < BLOCKS; ++i) {
+      sizes[i] = tbrandom(&seed) % 512;
+      addrs[i] = malloc(sizes[i]);
+      if(sizes[i] && !addrs[i]) {
+        tbprint("[thread %d] Failed to allocate %u bytes\n", num, sizes[i]);
+        return (void*)1;
+      }
+      for(int j = 0; j < sizes[i]; ++j)
+        addrs[i][j] = i;
+    }
+    for(int i = 0; i < BLOCKS; ++i) {
+      for(int j = 0; j < sizes[i]; ++j)
+        if(addrs[i][j] != (unsigned char)i) {
+          tbprint("[thread %d] Memory corruption in block %d\n", num, i);
+          return (void*)1;
+        }
+      free(addrs[i]);
+    }
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Run the allocations in the threads and the main thread
+//------------------------------------------------------------------------------
+int hammer()
+{
+  tbthread_t      thread[THREADS];
+  tbthread_attr_t attr;
+  int             targ[THREADS+1];
+  void           *ret;
+  int             fail = 0;
+
+  tbthread_attr_init(&attr);
+  for(int i = 0; i < THREADS; ++i) {
+    targ[i] = i+1;
+    int st = tbthread_create(&thread[i], &attr, thread_func, &targ[i]);
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      return 1;
+    }
+  }
+
+  targ[THREADS] = 0;
+  if(thread_func(&targ[THREADS]))
+    fail = 1;
+
+  for(int i = 0; i < THREADS; ++i) {
+    tbthread_join(thread[i], &ret);
+    if(ret)
+      fail = 1;
+  }
+  return fail;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  int fail = 0;
+
+  //----------------------------------------------------------------------------
+  // Run once with the thread caches, so that the descriptors of the threads
+  // are cached, take a snapshot of the heap and switch the arenas on
+  //----------------------------------------------------------------------------
+  if(hammer())
+    fail = 1;
+
+  uint64_t total, allocated, free_bytes, largest_free, allocated_before;
+  tb_heap_state(&total, &allocated_before, &free_bytes, &largest_free);
+
+  int st = tb_mallopt(TB_M_PERCPU, 1);
+  if(st == -ENOSYS) {
+    tbprint("Restartable sequences are not available, skipping\n");
+    tbthread_finit();
+    return 0;
+  }
+  if(st) {
+    tbprint("Unable to switch the per-CPU arenas on: %s\n", tbstrerror(-st));
+    return 1;
+  }
+
+  if(hammer())
+    fail = 1;
+
+  //----------------------------------------------------------------------------
+  // Switching the arenas off should give all the blocks back to the heap
+  //----------------------------------------------------------------------------
+  tb_heap_state(&total, &allocated, &free_bytes, &largest_free);
+  tbprint("Allocated chunks with the arenas on: %llu, before: %llu\n",
+    allocated, allocated_before);
+
+  tb_mallopt(TB_M_PERCPU, 0);
+  tb_heap_state(&total, &allocated, &free_bytes, &largest_free);
+  tbprint("Allocated chunks with the arenas off: %llu\n", allocated);
+  if(allocated > allocated_before) {
+    tbprint("The arenas still hold %llu blocks\n", allocated-allocated_before);
+    fail = 1;
+  }
+
+  //----------------------------------------------------------------------------
+  // The thread caches take over
+  //----------------------------------------------------------------------------
+  if(hammer())
+    fail = 1;
+
+  tbthread_finit();
+  if(fail) {
+    tbprint("Test failed\n");
+    return 1;
+  }
+  tbprint("All good\n");
+  return 0;
+}
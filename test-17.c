@@ -0,0 +1,205 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <string.h>
+
+#define THREADS 24
+#define RESERVOIR 4
+
+tbthread_mutex_t mutex = TBTHREAD_MUTEX_INITIALIZER;
+int detached_done = 0;
+int failed = 0;
+
+//------------------------------------------------------------------------------
+// The descriptor needs to sit at the top of the stack mapping and survive the
+// thread using its stack
+//------------------------------------------------------------------------------
+int check_desc(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  char buffer[4096];
+  memset(buffer, (int)(long)arg, sizeof(buffer));
+
+  char *top = (char *)self->stack + self->stack_size;
+  if((char *)self < buffer + sizeof(buffer) || (char *)self >= top ||
+     (char *)(self+1) > top) {
+    tbprint("[thread 0x%llx] The descriptor is not at the top of the stack "
+      "0x%llx-0x%llx\n", self, self->stack, top);
+    return -1;
+  }
+
+  for(int i = 0; i < sizeof(buffer); ++i)
+    if(buffer[i] != (char)(long)arg) {
+      tbprint("[thread 0x%llx] Stack corruption\n", self);
+      return -1;
+    }
+
+  if(self != tbthread_self() || self->arg != arg) {
+    tbprint("[thread 0x%llx] Descriptor corruption\n", self);
+    return -1;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Thread function, joinable
+//------------------------------------------------------------------------------
+void *thread_func(void *arg)
+{
+  if(check_desc(arg))
+    return 0;
+  return arg;
+}
+
+//------------------------------------------------------------------------------
+// Thread function, detached
+//------------------------------------------------------------------------------
+void *thread_func_detached(void *arg)
+{
+  int st = check_desc(arg);
+  tbthread_mutex_lock(&mutex);
+  ++detached_done;
+  if(st)
+    failed = 1;
+  tbthread_mutex_unlock(&mutex);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Thread function, exit from a nested call, the reservoir threads start over
+// at the top of the stack under the descriptor
+//------------------------------------------------------------------------------
+long nested_exit(int depth, void *arg)
+{
+  if(depth > 0)
+    return nested_exit(depth-1, arg) + depth;
+  if(arg)
+    tbthread_exit(arg);
+  return 0;
+}
+
+void *thread_func_exit(void *arg)
+{
+  if(check_desc(arg))
+    return 0;
+  return (void *)nested_exit(10, arg);
+}
+
+//------------------------------------------------------------------------------
+// Run more threads at once than the stack cache can hold, so that releasing
+// them evicts some of the stacks, the detached ones after the joinable ones
+//------------------------------------------------------------------------------
+int run(tbthread_attr_t *attr, void *(*func)(void *))
+{
+  tbthread_t      thread[THREADS];
+  tbthread_attr_t dattr;
+  void           *ret;
+  int             st;
+
+  for(long i = 0; i < THREADS; ++i) {
+    st = tbthread_create(&thread[i], attr, func, (void *)(i+1));
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      return st;
+    }
+  }
+
+  for(long i = 0; i < THREADS; ++i) {
+    st = tbthread_join(thread[i], &ret);
+    if(st != 0) {
+      tbprint("Failed to join thread %d: %s\n", i, tbstrerror(-st));
+      return st;
+    }
+    if(ret != (void *)(i+1)) {
+      tbprint("[thread main] Unexpected return value: 0x%llx\n", ret);
+      return -EINVAL;
+    }
+  }
+
+  dattr = *attr;
+  tbthread_attr_setdetachstate(&dattr, TBTHREAD_CREATE_DETACHED);
+  detached_done = 0;
+  for(long i = 0; i < THREADS; ++i) {
+    tbthread_t th;
+    st = tbthread_create(&th, &dattr, thread_func_detached, (void *)(i+1));
+    if(st != 0) {
+      tbprint("Failed to spawn thread %d: %s\n", i, tbstrerror(-st));
+      return st;
+    }
+  }
+
+  for(int i = 0; i < 5 && detached_done != THREADS; ++i)
+    tbsleep(1);
+
+  if(detached_done != THREADS || failed) {
+    tbprint("%d of %d detached threads finished, failed: %d\n", detached_done,
+      THREADS, failed);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_attr_t attr;
+  int             st = 0;
+  tbthread_attr_init(&attr);
+  tbthread_attr_setdescplacement(&attr, TBTHREAD_DESC_IN_STACK);
+
+  //----------------------------------------------------------------------------
+  // Spawn the threads a couple of times so that the cached stacks get reused,
+  // change the stack size in between so that some of them don't fit
+  //----------------------------------------------------------------------------
+  tbprint("[thread main] Testing the descriptors in the stack\n");
+  for(int i = 0; i < 4; ++i) {
+    attr.stack_size = (i % 2 ? 1024 : 8192) * 1024;
+    if((st = run(&attr, thread_func)))
+      goto exit;
+  }
+
+  //----------------------------------------------------------------------------
+  // The reservoir threads need to keep their descriptors intact when they
+  // come back after tbthread_exit
+  //----------------------------------------------------------------------------
+  tbprint("---\n");
+  tbprint("[thread main] Testing the reservoir\n");
+  st = tbthread_reservoir_init(RESERVOIR, &attr);
+  if(st != 0) {
+    tbprint("Failed to set up the reservoir: %s\n", tbstrerror(-st));
+    goto exit;
+  }
+
+  for(int i = 0; i < 2; ++i) {
+    if((st = run(&attr, thread_func_exit)))
+      goto exit;
+    if((st = run(&attr, thread_func)))
+      goto exit;
+  }
+  tbprint("[thread main] All good\n");
+
+exit:
+  tbthread_finit();
+  return st;
+};
@@ -0,0 +1,155 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <string.h>
+
+tbthread_cpuset_t all_cpus;
+tbthread_cpuset_t one_cpu;
+
+//------------------------------------------------------------------------------
+// Compare two CPU sets
+//------------------------------------------------------------------------------
+int same_cpus(const tbthread_cpuset_t *a, const tbthread_cpuset_t *b)
+{
+  return !memcmp(a, b, sizeof(tbthread_cpuset_t));
+}
+
+//------------------------------------------------------------------------------
+// Thread function, find out where an unpinned thread may run
+//------------------------------------------------------------------------------
+void *thread_probe(void *arg)
+{
+  tbthread_t self = tbthread_self();
+  int        st = tbthread_getaffinity(self, &all_cpus);
+  if(st) {
+    tbprint("[thread 0x%llx] Unable to get the affinity: %s\n", self,
+      tbstrerror(-st));
+    return (void *)1;
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Thread function, the thread should start pinned and be able to unpin itself
+//------------------------------------------------------------------------------
+void *thread_func(void *arg)
+{
+  tbthread_t        self = tbthread_self();
+  tbthread_cpuset_t set;
+  int               st;
+
+  if((st = tbthread_getaffinity(self, &set))) {
+    tbprint("[thread 0x%llx] Unable to get the affinity: %s\n", self,
+      tbstrerror(-st));
+    return (void *)1;
+  }
+
+  if(!same_cpus(&set, &one_cpu)) {
+    tbprint("[thread 0x%llx] The thread is not pinned\n", self);
+    return (void *)1;
+  }
+
+  if((st = tbthread_setaffinity(self, &all_cpus))) {
+    tbprint("[thread 0x%llx] Unable to set the affinity: %s\n", self,
+      tbstrerror(-st));
+    return (void *)1;
+  }
+
+  tbthread_getaffinity(self, &set);
+  if(!same_cpus(&set, &all_cpus)) {
+    tbprint("[thread 0x%llx] The thread is still pinned\n", self);
+    return (void *)1;
+  }
+
+  tbprint("[thread 0x%llx] Affinity OK\n", self);
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  tbthread_t        thread;
+  tbthread_attr_t   attr;
+  tbthread_cpuset_t set;
+  void             *ret;
+  int               st;
+
+  //----------------------------------------------------------------------------
+  // Pin the thread to the last CPU we're allowed to run on
+  //----------------------------------------------------------------------------
+  tbthread_attr_init(&attr);
+  if((st = tbthread_create(&thread, &attr, thread_probe, 0))) {
+    tbprint("Failed to spawn the probe thread: %s\n", tbstrerror(-st));
+    goto exit;
+  }
+
+  tbthread_join(thread, &ret);
+  if(ret) {
+    st = -EINVAL;
+    goto exit;
+  }
+
+  TBTHREAD_CPU_ZERO(&one_cpu);
+  for(int i = TBTHREAD_CPU_SETSIZE-1; i >= 0; --i)
+    if(TBTHREAD_CPU_ISSET(i, &all_cpus)) {
+      TBTHREAD_CPU_SET(i, &one_cpu);
+      tbprint("[thread main] Pinning the thread to CPU %d\n", i);
+      break;
+    }
+
+  tbthread_attr_setaffinity(&attr, &one_cpu);
+  if((st = tbthread_create(&thread, &attr, thread_func, 0))) {
+    tbprint("Failed to spawn the thread: %s\n", tbstrerror(-st));
+    goto exit;
+  }
+
+  tbthread_join(thread, &ret);
+  if(ret) {
+    st = -EINVAL;
+    goto exit;
+  }
+
+  //----------------------------------------------------------------------------
+  // The handle is stale after the join
+  //----------------------------------------------------------------------------
+  st = tbthread_setaffinity(thread, &all_cpus);
+  if(st != -ESRCH) {
+    tbprint("Setting the affinity of a joined thread returned: %d\n", st);
+    st = -EINVAL;
+    goto exit;
+  }
+
+  st = tbthread_getaffinity(thread, &set);
+  if(st != -ESRCH) {
+    tbprint("Getting the affinity of a joined thread returned: %d\n", st);
+    st = -EINVAL;
+    goto exit;
+  }
+  st = 0;
+  tbprint("[thread main] All good\n");
+
+exit:
+  tbthread_finit();
+  return st;
+};
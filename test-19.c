@@ -0,0 +1,377 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2016 by Lukasz Janyst <lukasz@jany.st>
+//------------------------------------------------------------------------------
+// This file is part of thread-bites.
+//
+// thread-bites is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// thread-bites is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with thread-bites.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#include <tb.h>
+#include <string.h>
+#include <asm-generic/param.h>
+
+//------------------------------------------------------------------------------
+// Prototype for a hidden function
+//------------------------------------------------------------------------------
+void tb_heap_state(uint64_t *total, uint64_t *allocated, uint64_t *free_bytes,
+  uint64_t *largest_free);
+
+//------------------------------------------------------------------------------
+// Check if a block is filled with the given byte
+//------------------------------------------------------------------------------
+int memory_filled(void *ptr, size_t size, unsigned char c)
+{
+  unsigned char *p = ptr;
+  for(size_t i = 0; i < size; ++i)
+    if(p[i] != c)
+      return 0;
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+// Number of chunks on the heap
+//------------------------------------------------------------------------------
+uint64_t heap_chunks()
+{
+  uint64_t total, allocated, free_bytes, largest_free;
+  tb_heap_state(&total, &allocated, &free_bytes, &largest_free);
+  return total;
+}
+
+//------------------------------------------------------------------------------
+// Large blocks get mapped on their own, sizes that cannot be mapped fail
+//------------------------------------------------------------------------------
+int test_large()
+{
+  if(malloc(SIZE_MAX) || malloc(SIZE_MAX-EXEC_PAGESIZE)) {
+    tbprint("Allocating SIZE_MAX bytes should have failed\n");
+    return 1;
+  }
+
+  uint64_t chunks = heap_chunks();
+  size_t   size = 1024*1024;
+  void    *ptr = malloc(size);
+  if(!ptr || heap_chunks() != chunks) {
+    tbprint("A large block should have been mapped outside of the heap\n");
+    return 1;
+  }
+  memset(ptr, 0xab, size);
+
+  if(realloc(ptr, SIZE_MAX)) {
+    tbprint("Reallocating to SIZE_MAX bytes should have failed\n");
+    return 1;
+  }
+
+  ptr = realloc(ptr, 4*size);
+  if(!ptr || !memory_filled(ptr, size, 0xab) || heap_chunks() != chunks) {
+    tbprint("Growing a mapped block lost its contents\n");
+    return 1;
+  }
+  memset(ptr, 0xcd, 4*size);
+  ptr = realloc(ptr, 2*size);
+  if(!ptr || !memory_filled(ptr, 2*size, 0xcd)) {
+    tbprint("Shrinking a mapped block lost its contents\n");
+    return 1;
+  }
+  free(ptr);
+
+  //----------------------------------------------------------------------------
+  // Lower the threshold so that a medium block gets mapped too
+  //----------------------------------------------------------------------------
+  tb_mallopt(TB_M_MMAP_THRESHOLD, 64*1024);
+  ptr = malloc(100*1024);
+  int mapped = heap_chunks() == chunks;
+  free(ptr);
+  tb_mallopt(TB_M_MMAP_THRESHOLD, 128*1024);
+  if(!ptr || !mapped) {
+    tbprint("The mmap threshold was not respected\n");
+    return 1;
+  }
+
+  tbprint("[thread main] Large allocations OK\n");
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Free memory at the top of the heap goes back to the system, either on
+// request or when there is more of it than the trim threshold
+//------------------------------------------------------------------------------
+uint64_t heap_free_bytes()
+{
+  uint64_t total, allocated, free_bytes, largest_free;
+  tb_heap_state(&total, &allocated, &free_bytes, &largest_free);
+  return free_bytes;
+}
+
+int heap_churn()
+{
+  void *ptrs[32];
+  for(int i = 0; i < 32; ++i)
+    if(!(ptrs[i] = malloc(16*1024)))
+      return 1;
+  for(int i = 31; i >= 0; --i)
+    free(ptrs[i]);
+  return 0;
+}
+
+int test_trim()
+{
+  tb_mallopt(TB_M_TRIM_THRESHOLD, SIZE_MAX);
+  if(heap_churn()) {
+    tbprint("Unable to allocate the blocks to trim\n");
+    return 1;
+  }
+
+  uint64_t untrimmed = heap_free_bytes();
+  if(!tb_malloc_trim(0) || heap_free_bytes() >= untrimmed) {
+    tbprint("Trimming didn't release anything, %llu free bytes left\n",
+      heap_free_bytes());
+    return 1;
+  }
+
+  tb_mallopt(TB_M_TRIM_THRESHOLD, 128*1024);
+  if(heap_churn()) {
+    tbprint("Unable to allocate the blocks to trim\n");
+    return 1;
+  }
+
+  if(heap_free_bytes() >= untrimmed) {
+    tbprint("The heap wasn't trimmed automatically, %llu free bytes left\n",
+      heap_free_bytes());
+    return 1;
+  }
+
+  tbprint("[thread main] Trimming OK\n");
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Blocks grow into the free chunk that follows them and shrink where they are
+//------------------------------------------------------------------------------
+int test_realloc()
+{
+  void *ptr = malloc(1000);
+  void *next = malloc(2000);
+  void *guard = malloc(1000);
+  if(!ptr || !next || !guard) {
+    tbprint("Unable to allocate the blocks to resize\n");
+    return 1;
+  }
+  free(next);
+  memset(ptr, 0x5a, 1000);
+
+  void *new_ptr = realloc(ptr, 2500);
+  if(new_ptr != ptr || !memory_filled(new_ptr, 1000, 0x5a)) {
+    tbprint("The block was not grown in place: 0x%llx -> 0x%llx\n", ptr,
+      new_ptr);
+    return 1;
+  }
+
+  new_ptr = realloc(ptr, 500);
+  if(new_ptr != ptr || !memory_filled(new_ptr, 500, 0x5a)) {
+    tbprint("The block was not shrunk in place: 0x%llx -> 0x%llx\n", ptr,
+      new_ptr);
+    return 1;
+  }
+
+  free(new_ptr);
+  free(guard);
+  tbprint("[thread main] Realloc in place OK\n");
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Calloc needs to clear the blocks that were used before, whichever path they
+// come from, and refuse the sizes that overflow
+//------------------------------------------------------------------------------
+int test_calloc()
+{
+  size_t sizes[] = {8, 24, 200, 1000, 5000, 200*1024};
+  for(int i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+    void *ptrs[8];
+    for(int j = 0; j < 8; ++j) {
+      if(!(ptrs[j] = malloc(sizes[i]))) {
+        tbprint("Unable to allocate %llu bytes\n", sizes[i]);
+        return 1;
+      }
+      memset(ptrs[j], 0xff, sizes[i]);
+    }
+    for(int j = 7; j >= 0; --j)
+      free(ptrs[j]);
+
+    for(int j = 0; j < 8; ++j)
+      if(!(ptrs[j] = calloc(sizes[i], 1)) ||
+         !memory_filled(ptrs[j], sizes[i], 0)) {
+        tbprint("Calloc of %llu bytes returned dirty memory\n", sizes[i]);
+        return 1;
+      }
+    for(int j = 0; j < 8; ++j)
+      free(ptrs[j]);
+  }
+
+  if(calloc(SIZE_MAX/2+1, 2) || calloc(SIZE_MAX, SIZE_MAX)) {
+    tbprint("Calloc should have failed on overflow\n");
+    return 1;
+  }
+
+  tbprint("[thread main] Calloc OK\n");
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Aligned blocks need to start at the requested boundary and must not overlap
+//------------------------------------------------------------------------------
+int test_aligned()
+{
+  size_t  sizes[] = {1, 100, 5000, 256*1024};
+  void   *ptrs[4][9];
+  int     st;
+
+  for(int i = 0; i < 4; ++i)
+    for(int j = 0; j < 9; ++j) {
+      size_t alignment = 16 << j;
+      if(j % 2)
+        st = posix_memalign(&ptrs[i][j], alignment, sizes[i]);
+      else {
+        ptrs[i][j] = tb_aligned_alloc(alignment, sizes[i]);
+        st = ptrs[i][j] ? 0 : ENOMEM;
+      }
+      if(st || (uint64_t)ptrs[i][j] % alignment) {
+        tbprint("Block of %llu bytes aligned to %llu is at 0x%llx\n",
+          sizes[i], alignment, ptrs[i][j]);
+        return 1;
+      }
+      memset(ptrs[i][j], i*9+j, sizes[i]);
+    }
+
+  for(int i = 0; i < 4; ++i)
+    for(int j = 0; j < 9; ++j) {
+      if(!memory_filled(ptrs[i][j], sizes[i], i*9+j)) {
+        tbprint("Aligned blocks overlap\n");
+        return 1;
+      }
+      free(ptrs[i][j]);
+    }
+
+  void *ptr;
+  if(tb_aligned_alloc(24, 100) || tb_aligned_alloc(64, SIZE_MAX) ||
+     posix_memalign(&ptr, 4, 100) != EINVAL ||
+     posix_memalign(&ptr, 48, 100) != EINVAL) {
+    tbprint("Invalid alignment or size should have been refused\n");
+    return 1;
+  }
+
+  //----------------------------------------------------------------------------
+  // The cache line arrays are aligned, padded and zeroed
+  //----------------------------------------------------------------------------
+  ptr = tb_calloc_cacheline(10, 24);
+  if(!ptr || (uint64_t)ptr % TB_CACHELINE_SIZE ||
+     !memory_filled(ptr, 10*TB_CACHELINE_SIZE, 0)) {
+    tbprint("Cache line array is not aligned or not zeroed: 0x%llx\n", ptr);
+    return 1;
+  }
+  free(ptr);
+
+  tbprint("[thread main] Aligned allocations OK\n");
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Object caches construct each object once, when its slab is carved, and
+// keep it untouched while it sits in the cache
+//------------------------------------------------------------------------------
+#define OBJ_SIZE 20
+#define OBJ_NUM  100
+
+int constructed = 0;
+
+void obj_ctor(void *obj)
+{
+  memset(obj, 0x11, OBJ_SIZE);
+  ++constructed;
+}
+
+int test_objcache()
+{
+  tb_objcache_t *cache = tb_objcache_create(OBJ_SIZE, obj_ctor);
+  void          *objs[OBJ_NUM];
+  if(!cache) {
+    tbprint("Unable to create an object cache\n");
+    return 1;
+  }
+
+  for(int i = 0; i < OBJ_NUM; ++i) {
+    objs[i] = tb_objcache_alloc(cache);
+    if(!objs[i] || (uint64_t)objs[i] % 8 ||
+       !memory_filled(objs[i], OBJ_SIZE, 0x11)) {
+      tbprint("Object %d is misaligned or not constructed: 0x%llx\n", i,
+        objs[i]);
+      return 1;
+    }
+    memset(objs[i], i, OBJ_SIZE);
+  }
+
+  //----------------------------------------------------------------------------
+  // Give back every other object in its constructed state, the remaining ones
+  // need to stay intact and the ones we get again need to be still
+  // constructed
+  //----------------------------------------------------------------------------
+  int num_constructed = constructed;
+  for(int i = 0; i < OBJ_NUM; i += 2) {
+    memset(objs[i], 0x11, OBJ_SIZE);
+    tb_objcache_free(cache, objs[i]);
+  }
+
+  for(int i = 0; i < OBJ_NUM; i += 2)
+    objs[i] = tb_objcache_alloc(cache);
+
+  for(int i = 0; i < OBJ_NUM; ++i)
+    if(!memory_filled(objs[i], OBJ_SIZE, i % 2 ? i : 0x11)) {
+      tbprint("Object %d was overwritten in the cache\n", i);
+      return 1;
+    }
+
+  if(constructed != num_constructed) {
+    tbprint("Objects were constructed again\n");
+    return 1;
+  }
+
+  tb_objcache_destroy(cache);
+  tbprint("[thread main] Object cache OK\n");
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// Start the show
+//------------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  tbthread_init();
+
+  int fail = 0;
+  fail |= test_large();
+  fail |= test_trim();
+  fail |= test_realloc();
+  fail |= test_calloc();
+  fail |= test_aligned();
+  fail |= test_objcache();
+
+  tbthread_finit();
+  if(fail) {
+    tbprint("Test failed\n");
+    return 1;
+  }
+  tbprint("All good\n");
+  return 0;
+}